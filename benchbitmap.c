@@ -0,0 +1,169 @@
+//
+// Microbenchmark for the filesystem bitmap allocator.  Compares the
+// word-at-a-time allocator in filesystem.c against the original
+// bit-by-bit loops on empty, full and fragmented bitmaps.
+//
+// Built like formatfs: cc -O2 -o benchbitmap benchbitmap.c
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
+#include "filesystem.c"
+#include "filesystem.h"
+
+#define NBITS (4096 * 8)
+
+// the original allocator loops, kept for comparison
+
+static int64_t loop_allocate_bit(uint8_t *data, uint64_t nbits) {
+  int64_t i, j;
+  for (i=0; i < 4096; i++) {
+    for (j=0; j <= 7; j++) {
+      if ((uint64_t)(i*8+j) >= nbits) {
+        return -1;
+      }
+      if ((data[i] & (1 << j)) == 0) {
+        return i*8+j;
+      }
+    }
+  }
+  return -1;
+}
+
+static void loop_used_bit(uint8_t *data, int64_t index) {
+  int64_t i, j;
+  for (i=0; i < 4096; i++) {
+    for (j=0; j <= 7; j++) {
+      if (i*8+j == index) {
+        data[i] |= 1UL << j;
+      }
+    }
+  }
+}
+
+static void loop_free_bit(uint8_t *data, int64_t index) {
+  int64_t i, j;
+  for (i=0; i < 4096; i++) {
+    for (j=0; j <= 7; j++) {
+      if (i*8+j == index) {
+        data[i] &= ~(1UL << j);
+      }
+    }
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *scenario, const char *impl, long ops, double secs) {
+  printf("%-12s %-6s %10ld ops %12.1f ns/op\n", scenario, impl, ops, secs * 1e9 / ops);
+}
+
+// fragmented bitmap: every bit set except a random 1 in 'one_in'
+static void fragment(Bitmap *b, unsigned seed, int one_in) {
+  int i;
+  srand(seed);
+  memset(b->bytes, 0xff, sizeof(b->bytes));
+  for (i=0; i < NBITS; i++) {
+    if (rand() % one_in == 0) {
+      b->bytes[i / 8] &= ~(1 << (i % 8));
+    }
+  }
+}
+
+// allocate every bit of an empty bitmap
+static void bench_fill(void) {
+  static Bitmap b, ab;
+  BitAllocator a={ .words=ab.words };
+  double t;
+  long i;
+
+  bzero(&b, sizeof(b));
+  t=now();
+  for (i=0; i < NBITS; i++) {
+    loop_used_bit(b.bytes, loop_allocate_bit(b.bytes, NBITS));
+  }
+  report("fill-empty", "loops", NBITS, now() - t);
+
+  bzero(&ab, sizeof(ab));
+  init_bit_allocator(&a, 0, NBITS);
+  t=now();
+  for (i=0; i < NBITS; i++) {
+    allocate_bit(&a);
+  }
+  report("fill-empty", "words", NBITS, now() - t);
+}
+
+// allocation attempts against a completely full bitmap
+static void bench_full(long ops) {
+  static Bitmap b, ab;
+  BitAllocator a={ .words=ab.words };
+  volatile int64_t sink=0;
+  double t;
+  long i;
+
+  memset(b.bytes, 0xff, sizeof(b.bytes));
+  t=now();
+  for (i=0; i < ops; i++) {
+    sink+=loop_allocate_bit(b.bytes, NBITS);
+  }
+  report("full", "loops", ops, now() - t);
+
+  memset(ab.bytes, 0xff, sizeof(ab.bytes));
+  init_bit_allocator(&a, 0, NBITS);
+  t=now();
+  for (i=0; i < ops; i++) {
+    sink+=allocate_bit(&a);
+  }
+  report("full", "words", ops, now() - t);
+}
+
+// free a random used bit, then allocate, on a mostly full bitmap
+static void bench_fragmented(long ops) {
+  static Bitmap b, ab;
+  BitAllocator a={ .words=ab.words };
+  int64_t *victims=malloc(ops * sizeof(int64_t));
+  double t;
+  long i;
+
+  fragment(&b, 4103, 16);
+  srand(1);
+  for (i=0; i < ops; i++) {
+    victims[i]=rand() % NBITS;
+  }
+
+  t=now();
+  for (i=0; i < ops; i++) {
+    loop_free_bit(b.bytes, victims[i]);
+    loop_used_bit(b.bytes, loop_allocate_bit(b.bytes, NBITS));
+  }
+  report("fragmented", "loops", ops, now() - t);
+
+  fragment(&ab, 4103, 16);
+  init_bit_allocator(&a, 0, NBITS);
+  t=now();
+  for (i=0; i < ops; i++) {
+    free_bit(&a, victims[i]);
+    allocate_bit(&a);
+  }
+  report("fragmented", "words", ops, now() - t);
+  free(victims);
+}
+
+int main(int argc, char *argv[]) {
+  long ops=argc > 1 ? atol(argv[1]) : 2000;
+
+  bench_fill();
+  bench_full(ops);
+  bench_fragmented(ops);
+  return 0;
+}
@@ -0,0 +1,352 @@
+//
+// Benchmark suite for the filesystem and software disk APIs.  Measures
+// throughput and latency percentiles for file churn, small random I/O,
+// large sequential streams and raw block access.
+//
+// Built like formatfs: cc -O2 -o benchfs benchfs.c
+//
+// Usage: benchfs [ops]
+//
+// Results are printed one benchmark per line as tab-separated columns
+// under a '#' header, so runs can be diffed or loaded into a spreadsheet
+// to track regressions between releases.  Lines starting with '#' are
+// comments, such as the commit counters of the group commit runs.  The
+// software disk is reformatted before and after the run.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
+#include "filesystem.c"
+#include "filesystem.h"
+
+#define SMALL_IO_BYTES 256
+#define SMALL_IO_FILE_SIZE (1024 * 1024)
+#define STREAM_CHUNK (64 * 1024)
+#define GROUP_COMMIT_OPS 64
+
+// per-operation latencies of the benchmark being run
+typedef struct Timer {
+  double *lat;               // seconds per operation
+  long n;                    // operations recorded
+  long max;                  // capacity of 'lat'
+  unsigned long long bytes;  // bytes moved, 0 for metadata operations
+  double start;              // start of the current operation
+  double total;              // sum of 'lat'
+} Timer;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void timer_init(Timer *t, long max) {
+  t->lat=malloc(max * sizeof(double));
+  if (! t->lat) {
+    fprintf(stderr, "benchfs: out of memory\n");
+    exit(1);
+  }
+  t->n=0;
+  t->max=max;
+  t->bytes=0;
+  t->total=0;
+}
+
+static void timer_start(Timer *t) {
+  t->start=now();
+}
+
+static void timer_stop(Timer *t, unsigned long bytes) {
+  double d=now() - t->start;
+  if (t->n < t->max) {
+    t->lat[t->n++]=d;
+  }
+  t->total+=d;
+  t->bytes+=bytes;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x=*(const double *)a, y=*(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// latency at percentile 'p' in microseconds; 'lat' must be sorted
+static double percentile(Timer *t, double p) {
+  long i=(long)(p / 100.0 * (t->n - 1) + 0.5);
+  return t->n ? t->lat[i] * 1e6 : 0.0;
+}
+
+static void report_header(long ops) {
+  printf("# benchfs ops=%ld disk_blocks=%lu block_size=%d cache_blocks=%d\n",
+         ops, software_disk_size(), SOFTWARE_DISK_BLOCK_SIZE, DEFAULT_CACHE_BLOCKS);
+  printf("# benchmark\tops\tsecs\tops_per_sec\tMB_per_sec\tp50_us\tp90_us\tp99_us\tmax_us\n");
+}
+
+static void report(const char *name, Timer *t) {
+  qsort(t->lat, t->n, sizeof(double), cmp_double);
+  printf("%s\t%ld\t%.6f\t%.1f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+         name, t->n, t->total,
+         t->total > 0 ? t->n / t->total : 0.0,
+         t->total > 0 ? t->bytes / t->total / (1024.0 * 1024.0) : 0.0,
+         percentile(t, 50), percentile(t, 90), percentile(t, 99),
+         percentile(t, 100));
+  fflush(stdout);
+  free(t->lat);
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "benchfs: %s failed: ", what);
+  fs_print_error();
+  exit(1);
+}
+
+// create, close, open, close and delete 'ops' files, timing each step
+static void bench_churn(long ops) {
+  Timer create, open, close, delete;
+  char name[MAX_FILENAME_SIZE];
+  long i;
+  File f;
+
+  timer_init(&create, ops);
+  timer_init(&open, ops);
+  timer_init(&close, ops * 2);
+  timer_init(&delete, ops);
+  for (i=0; i < ops; i++) {
+    sprintf(name, "churn%ld", i % DEFAULT_MAX_FILES);
+
+    timer_start(&create);
+    f=create_file(name);
+    timer_stop(&create, 0);
+    if (! f) {
+      fail("create_file");
+    }
+    timer_start(&close);
+    close_file(f);
+    timer_stop(&close, 0);
+
+    timer_start(&open);
+    f=open_file(name, READ_WRITE);
+    timer_stop(&open, 0);
+    if (! f) {
+      fail("open_file");
+    }
+    timer_start(&close);
+    close_file(f);
+    timer_stop(&close, 0);
+
+    timer_start(&delete);
+    if (! delete_file(name)) {
+      fail("delete_file");
+    }
+    timer_stop(&delete, 0);
+  }
+  report("create_file", &create);
+  report("open_file", &open);
+  report("close_file", &close);
+  report("delete_file", &delete);
+}
+
+// create, close and delete 'ops' files with every call committed on its
+// own, then with group commit, ending each run with a sync_fs() barrier
+static void bench_group_commit(long ops) {
+  static const unsigned long windows[]={1, GROUP_COMMIT_OPS};
+  char name[MAX_FILENAME_SIZE], row[64];
+  CommitStats stats;
+  unsigned long w;
+  Timer t;
+  long i;
+  File f;
+
+  for (w=0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+    if (! sync_fs()) {
+      fail("sync_fs");
+    }
+    set_group_commit(windows[w], 0);
+    reset_commit_stats();
+    timer_init(&t, ops);
+    for (i=0; i < ops; i++) {
+      sprintf(name, "group%ld", i % DEFAULT_MAX_FILES);
+      timer_start(&t);
+      f=create_file(name);
+      if (! f) {
+        fail("create_file");
+      }
+      close_file(f);
+      if (! delete_file(name)) {
+        fail("delete_file");
+      }
+      timer_stop(&t, 0);
+    }
+    if (! sync_fs()) {
+      fail("sync_fs");
+    }
+    get_commit_stats(&stats);
+    sprintf(row, "churn_commit_%lu", windows[w]);
+    report(row, &t);
+    printf("#   commits=%lu mean_batch=%.1f mean_commit_us=%.1f max_commit_us=%llu\n",
+           stats.commits,
+           stats.commits ? (double)stats.operations / stats.commits : 0.0,
+           stats.commits ? (double)stats.total_usecs / stats.commits : 0.0,
+           stats.max_usecs);
+  }
+  set_group_commit(0, 0);
+}
+
+// small reads and writes at random offsets within one file
+static void bench_small_random(long ops) {
+  Timer rd, wr;
+  char buf[SMALL_IO_BYTES];
+  unsigned long pos;
+  long i;
+  File f;
+
+  f=create_file("small");
+  if (! f) {
+    fail("create_file");
+  }
+  memset(buf, 'r', sizeof(buf));
+  for (pos=0; pos < SMALL_IO_FILE_SIZE; pos+=sizeof(buf)) {
+    if (write_file(f, buf, sizeof(buf)) != sizeof(buf)) {
+      fail("write_file");
+    }
+  }
+
+  srand(4103);
+  timer_init(&wr, ops);
+  for (i=0; i < ops; i++) {
+    pos=(unsigned long)rand() % (SMALL_IO_FILE_SIZE - SMALL_IO_BYTES);
+    timer_start(&wr);
+    seek_file(f, pos);
+    if (write_file(f, buf, sizeof(buf)) != sizeof(buf)) {
+      fail("write_file");
+    }
+    timer_stop(&wr, sizeof(buf));
+  }
+
+  timer_init(&rd, ops);
+  for (i=0; i < ops; i++) {
+    pos=(unsigned long)rand() % (SMALL_IO_FILE_SIZE - SMALL_IO_BYTES);
+    timer_start(&rd);
+    seek_file(f, pos);
+    if (read_file(f, buf, sizeof(buf)) != sizeof(buf)) {
+      fail("read_file");
+    }
+    timer_stop(&rd, sizeof(buf));
+  }
+  close_file(f);
+  delete_file("small");
+  report("random_write_256", &wr);
+  report("random_read_256", &rd);
+}
+
+// write then read back a file of MAX_FILE_SIZE in STREAM_CHUNK pieces
+static void bench_stream(void) {
+  Timer rd, wr;
+  char *buf=malloc(STREAM_CHUNK);
+  unsigned long pos, len;
+  long chunks=(MAX_FILE_SIZE + STREAM_CHUNK - 1) / STREAM_CHUNK;
+  File f;
+
+  if (! buf) {
+    fprintf(stderr, "benchfs: out of memory\n");
+    exit(1);
+  }
+  memset(buf, 's', STREAM_CHUNK);
+  f=create_file("stream");
+  if (! f) {
+    fail("create_file");
+  }
+
+  timer_init(&wr, chunks);
+  for (pos=0; pos < MAX_FILE_SIZE; pos+=len) {
+    len=MAX_FILE_SIZE - pos < STREAM_CHUNK ? MAX_FILE_SIZE - pos : STREAM_CHUNK;
+    timer_start(&wr);
+    if (write_file(f, buf, len) != len) {
+      fail("write_file");
+    }
+    timer_stop(&wr, len);
+  }
+
+  timer_init(&rd, chunks);
+  seek_file(f, 0);
+  for (pos=0; pos < MAX_FILE_SIZE; pos+=len) {
+    len=MAX_FILE_SIZE - pos < STREAM_CHUNK ? MAX_FILE_SIZE - pos : STREAM_CHUNK;
+    timer_start(&rd);
+    if (read_file(f, buf, len) != len) {
+      fail("read_file");
+    }
+    timer_stop(&rd, len);
+  }
+  close_file(f);
+  delete_file("stream");
+  free(buf);
+  report("seq_write_64k", &wr);
+  report("seq_read_64k", &rd);
+}
+
+// raw read_sd_block/write_sd_block on random blocks.  This scribbles on
+// the disk, so it runs after the filesystem is unmounted.
+static void bench_raw(long ops) {
+  Timer rd, wr;
+  char buf[SOFTWARE_DISK_BLOCK_SIZE];
+  unsigned long b;
+  long i;
+
+  memset(buf, 'b', sizeof(buf));
+  srand(4103);
+  timer_init(&wr, ops);
+  for (i=0; i < ops; i++) {
+    b=(unsigned long)rand() % software_disk_size();
+    timer_start(&wr);
+    if (! write_sd_block(buf, b)) {
+      sd_print_error();
+      exit(1);
+    }
+    timer_stop(&wr, sizeof(buf));
+  }
+
+  timer_init(&rd, ops);
+  for (i=0; i < ops; i++) {
+    b=(unsigned long)rand() % software_disk_size();
+    timer_start(&rd);
+    if (! read_sd_block(buf, b)) {
+      sd_print_error();
+      exit(1);
+    }
+    timer_stop(&rd, sizeof(buf));
+  }
+  report("write_sd_block", &wr);
+  report("read_sd_block", &rd);
+}
+
+int main(int argc, char *argv[]) {
+  long ops=argc > 1 ? atol(argv[1]) : 1000;
+
+  if (ops <= 0) {
+    fprintf(stderr, "usage: benchfs [ops]\n");
+    return 1;
+  }
+  if (! init_software_disk() || ! mount_fs()) {
+    fail("format");
+  }
+
+  report_header(ops);
+  bench_churn(ops);
+  bench_group_commit(ops);
+  bench_small_random(ops);
+  bench_stream();
+  if (! unmount_fs()) {
+    fail("unmount_fs");
+  }
+  bench_raw(ops);
+
+  // leave a freshly formatted disk behind
+  init_software_disk();
+  return 0;
+}
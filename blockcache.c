@@ -0,0 +1,684 @@
+//
+// Write-back block cache layered over the software disk for the LSU 4103
+// filesystem assignment.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+#include "sdasync.h"
+
+#define NO_SLOT (-1L)
+#define ALL_PINNED (-2L)           // no slot can be given up
+
+// a single cached block
+typedef struct CacheSlot {
+  unsigned long blocknum;    // software disk block held in this slot
+  int valid;                 // slot holds a block
+  int dirty;                 // slot differs from the software disk
+  int referenced;            // CLOCK reference bit
+  unsigned long pins;        // pin_cached_block() calls not yet undone
+  long prev, next;           // LRU list, most recently used at head
+  long hash_next;            // chain in hash bucket
+  char *data;                // SOFTWARE_DISK_BLOCK_SIZE bytes
+} CacheSlot;
+
+// internals of block cache implementation
+typedef struct BlockCacheInternals {
+  int initialized;
+  BCPolicy policy;
+  unsigned long nslots;
+  unsigned long nused;       // slots handed out so far
+  unsigned long nbuckets;
+  CacheSlot *slots;
+  long *buckets;
+  char *data;
+  long head, tail;           // LRU list ends
+  unsigned long hand;        // CLOCK hand
+  BCStats stats;
+  FSLock lock;               // guards the cache.  Disk transfers for
+                             // vectored requests happen outside it.
+  SoftwareDisk disk;         // disk cached, NULL for the default one
+  unsigned long disk_blocks; // its size, 0 until looked up again
+  struct BlockCacheInternals *next; // next cache in 'caches'
+} BlockCacheInternals;
+
+// GLOBALS
+
+static BlockCacheInternals default_bc = { .lock=FS_LOCK_INITIALIZER };
+
+// the cache the calling thread's calls act on
+static FS_THREAD_LOCAL BlockCacheInternals *bc = &default_bc;
+
+// every cache, so all of them are written back at exit
+static BlockCacheInternals *caches = &default_bc;
+static FSLock caches_lock = FS_LOCK_INITIALIZER;
+
+static void flush_at_exit(void) {
+  BlockCacheInternals *saved=bc;
+  SoftwareDisk disk=current_software_disk();
+
+  fs_lock(&caches_lock);
+  for (bc=caches; bc; bc=bc->next) {
+    use_software_disk(bc->disk);
+    flush_block_cache();
+  }
+  fs_unlock(&caches_lock);
+  bc=saved;
+  use_software_disk(disk);
+}
+
+static unsigned long bucket_for(unsigned long blocknum) {
+  return (blocknum * 2654435761UL) % bc->nbuckets;
+}
+
+static long lookup_slot(unsigned long blocknum) {
+  long s;
+  for (s=bc->buckets[bucket_for(blocknum)]; s != NO_SLOT; s=bc->slots[s].hash_next) {
+    if (bc->slots[s].blocknum == blocknum) {
+      return s;
+    }
+  }
+  return NO_SLOT;
+}
+
+static void hash_insert(long s) {
+  unsigned long b=bucket_for(bc->slots[s].blocknum);
+  bc->slots[s].hash_next=bc->buckets[b];
+  bc->buckets[b]=s;
+}
+
+static void hash_remove(long s) {
+  long *p=&bc->buckets[bucket_for(bc->slots[s].blocknum)];
+  while (*p != NO_SLOT) {
+    if (*p == s) {
+      *p=bc->slots[s].hash_next;
+      return;
+    }
+    p=&bc->slots[*p].hash_next;
+  }
+}
+
+static void lru_unlink(long s) {
+  CacheSlot *slot=&bc->slots[s];
+  if (slot->prev != NO_SLOT) {
+    bc->slots[slot->prev].next=slot->next;
+  }
+  else {
+    bc->head=slot->next;
+  }
+  if (slot->next != NO_SLOT) {
+    bc->slots[slot->next].prev=slot->prev;
+  }
+  else {
+    bc->tail=slot->prev;
+  }
+  slot->prev=slot->next=NO_SLOT;
+}
+
+static void lru_push_front(long s) {
+  bc->slots[s].prev=NO_SLOT;
+  bc->slots[s].next=bc->head;
+  if (bc->head != NO_SLOT) {
+    bc->slots[bc->head].prev=s;
+  }
+  bc->head=s;
+  if (bc->tail == NO_SLOT) {
+    bc->tail=s;
+  }
+}
+
+// record a use of slot 's' for the replacement policy
+static void touch_slot(long s) {
+  if (bc->policy == BC_LRU) {
+    if (bc->head != s) {
+      lru_unlink(s);
+      lru_push_front(s);
+    }
+  }
+  else {
+    bc->slots[s].referenced=1;
+  }
+}
+
+static int write_back_slot(long s) {
+  if (bc->slots[s].valid && bc->slots[s].dirty) {
+    if (! write_sd_block(bc->slots[s].data, bc->slots[s].blocknum)) {
+      return 0;
+    }
+    bc->slots[s].dirty=0;
+    bc->stats.writebacks++;
+  }
+  return 1;
+}
+
+// choose a slot to hold a new block, evicting (and writing back) a
+// victim if the cache is full.  Pinned slots are passed over.  Returns
+// NO_SLOT on failure, or ALL_PINNED if every slot is pinned.
+static long claim_slot(void) {
+  unsigned long i;
+  long s;
+
+  if (bc->nused < bc->nslots) {
+    s=(long)bc->nused++;
+  }
+  else if (bc->policy == BC_LRU) {
+    for (s=bc->tail; s != NO_SLOT && bc->slots[s].pins > 0; s=bc->slots[s].prev) {
+    }
+    if (s == NO_SLOT) {
+      return ALL_PINNED;
+    }
+  }
+  else {
+    // two sweeps clear every reference bit, so a third finds nothing new
+    for (i=0; ; i++) {
+      if (i == 2 * bc->nslots) {
+        return ALL_PINNED;
+      }
+      s=(long)bc->hand;
+      bc->hand=(bc->hand + 1) % bc->nslots;
+      if (bc->slots[s].pins > 0) {
+        continue;
+      }
+      if (! bc->slots[s].referenced) {
+        break;
+      }
+      bc->slots[s].referenced=0;
+    }
+  }
+
+  if (bc->slots[s].valid) {
+    if (! write_back_slot(s)) {
+      return NO_SLOT;
+    }
+    hash_remove(s);
+    bc->slots[s].valid=0;
+    bc->stats.evictions++;
+  }
+  if (bc->policy == BC_LRU && (bc->slots[s].prev != NO_SLOT || bc->head == s)) {
+    lru_unlink(s);
+  }
+  return s;
+}
+
+static void release_cache(void) {
+  free(bc->slots);
+  free(bc->buckets);
+  free(bc->data);
+  bc->slots=NULL;
+  bc->buckets=NULL;
+  bc->data=NULL;
+  bc->nslots=bc->nused=bc->nbuckets=0;
+  bc->disk_blocks=0;
+  bc->initialized=0;
+}
+
+// writes every dirty block back, with all the writes queued at once so
+// they can overlap.  The caller holds the cache's lock.
+static int flush_cache(void) {
+  SDRequest *reqs;
+  long *slots;
+  unsigned long i, n=0;
+  int ret=1;
+
+  reqs=malloc(bc->nused * sizeof(SDRequest));
+  slots=malloc(bc->nused * sizeof(long));
+  if (! reqs || ! slots) {
+    free(reqs);
+    free(slots);
+    for (i=0; i < bc->nused; i++) {
+      if (! write_back_slot((long)i)) {
+        ret=0;
+      }
+    }
+    return ret;
+  }
+
+  for (i=0; i < bc->nused; i++) {
+    if (bc->slots[i].valid && bc->slots[i].dirty) {
+      bzero(&reqs[n], sizeof(SDRequest));
+      reqs[n].write=1;
+      reqs[n].buf=bc->slots[i].data;
+      reqs[n].blocknum=bc->slots[i].blocknum;
+      reqs[n].count=1;
+      if (! submit_sd_request(&reqs[n])) {
+        ret=write_back_slot((long)i) && ret;
+        continue;
+      }
+      slots[n++]=(long)i;
+    }
+  }
+  for (i=0; i < n; i++) {
+    if (wait_sd_request(&reqs[i])) {
+      bc->slots[slots[i]].dirty=0;
+      bc->stats.writebacks++;
+    }
+    else {
+      ret=0;
+    }
+  }
+  free(reqs);
+  free(slots);
+  return ret;
+}
+
+// the body of init_block_cache().  The caller holds the cache's lock.
+static int init_cache(unsigned long nblocks, BCPolicy policy) {
+  static int registered=0;
+  static FSLock registered_lock=FS_LOCK_INITIALIZER;
+  unsigned long i;
+  void *data;
+
+  if (bc->initialized && ! flush_cache()) {
+    return 0;
+  }
+  release_cache();
+
+  bc->policy=policy;
+  bc->head=bc->tail=NO_SLOT;
+  bc->hand=0;
+  bzero(&bc->stats, sizeof(bc->stats));
+  if (nblocks > 0) {
+    bc->nbuckets=nblocks * 2 + 1;
+    bc->slots=calloc(nblocks, sizeof(CacheSlot));
+    bc->buckets=malloc(bc->nbuckets * sizeof(long));
+    // block aligned, so the direct backend transfers cached blocks in place
+    if (posix_memalign(&data, SOFTWARE_DISK_BLOCK_SIZE, nblocks * SOFTWARE_DISK_BLOCK_SIZE) == 0) {
+      bc->data=data;
+    }
+    if (! bc->slots || ! bc->buckets || ! bc->data) {
+      release_cache();
+      return 0;
+    }
+    for (i=0; i < bc->nbuckets; i++) {
+      bc->buckets[i]=NO_SLOT;
+    }
+    for (i=0; i < nblocks; i++) {
+      bc->slots[i].prev=bc->slots[i].next=bc->slots[i].hash_next=NO_SLOT;
+      bc->slots[i].data=bc->data + i * SOFTWARE_DISK_BLOCK_SIZE;
+    }
+  }
+  bc->nslots=nblocks;
+  bc->initialized=1;
+
+  // caches on other threads can be set up at the same time
+  fs_lock(&registered_lock);
+  if (! registered) {
+    atexit(flush_at_exit);
+    registered=1;
+  }
+  fs_unlock(&registered_lock);
+  return 1;
+}
+
+// returns the size of the cached disk, looked up once rather than on
+// every access.  The caller holds the cache's lock.
+static unsigned long disk_blocks(void) {
+  if (bc->disk_blocks == 0) {
+    bc->disk_blocks=software_disk_size();
+  }
+  return bc->disk_blocks;
+}
+
+static int ensure_init(void) {
+  if (bc->initialized) {
+    return 1;
+  }
+  return init_cache(DEFAULT_CACHE_BLOCKS, BC_LRU);
+}
+
+// finds the slot holding block 'blocknum', claiming one on a miss and
+// filling it from the software disk if 'fill' is set; otherwise the
+// caller overwrites it.  The caller holds the cache's lock and has
+// checked that the cache is enabled.  Returns NO_SLOT on failure, or
+// ALL_PINNED if the block isn't cached and no slot is free.
+static long get_slot(unsigned long blocknum, int fill) {
+  long s;
+
+  s=lookup_slot(blocknum);
+  if (s != NO_SLOT) {
+    bc->stats.hits++;
+    touch_slot(s);
+    return s;
+  }
+
+  bc->stats.misses++;
+  s=claim_slot();
+  if (s == NO_SLOT || s == ALL_PINNED) {
+    return s;
+  }
+  if (fill && ! read_sd_block(bc->slots[s].data, blocknum)) {
+    // keep the empty slot reachable by the replacement policy
+    if (bc->policy == BC_LRU) {
+      lru_push_front(s);
+    }
+    return NO_SLOT;
+  }
+  bc->slots[s].blocknum=blocknum;
+  bc->slots[s].valid=1;
+  bc->slots[s].dirty=0;
+  hash_insert(s);
+  if (bc->policy == BC_LRU) {
+    lru_push_front(s);
+  }
+  touch_slot(s);
+  return s;
+}
+
+// the body of read_cached_block().  The caller holds the cache's lock.
+static int read_block(void *buf, unsigned long blocknum) {
+  long s;
+
+  if (! ensure_init()) {
+    return 0;
+  }
+  if (bc->nslots == 0) {
+    bc->stats.misses++;
+    return read_sd_block(buf, blocknum);
+  }
+
+  s=get_slot(blocknum, 1);
+  if (s == ALL_PINNED) {
+    return read_sd_block(buf, blocknum);
+  }
+  if (s == NO_SLOT) {
+    return 0;
+  }
+  memcpy(buf, bc->slots[s].data, SOFTWARE_DISK_BLOCK_SIZE);
+  sderror=SD_NONE;
+  return 1;
+}
+
+// the body of write_cached_block().  The caller holds the cache's lock.
+static int write_block(void *buf, unsigned long blocknum) {
+  long s;
+
+  if (! ensure_init()) {
+    return 0;
+  }
+  if (bc->nslots == 0) {
+    return write_sd_block(buf, blocknum);
+  }
+  if (blocknum >= disk_blocks()) {
+    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+    return 0;
+  }
+
+  s=get_slot(blocknum, 0);
+  if (s == ALL_PINNED) {
+    return write_sd_block(buf, blocknum);
+  }
+  if (s == NO_SLOT) {
+    return 0;
+  }
+  memcpy(bc->slots[s].data, buf, SOFTWARE_DISK_BLOCK_SIZE);
+  bc->slots[s].dirty=1;
+  sderror=SD_NONE;
+  return 1;
+}
+
+// makes a cache for 'disk', NULL for the default disk.  It is set up as
+// the default cache is, the first time it is used.  Returns NULL if out
+// of memory.
+BlockCache new_block_cache(SoftwareDisk disk) {
+  BlockCache cache=calloc(1, sizeof(BlockCacheInternals));
+
+  if (! cache) {
+    return NULL;
+  }
+  cache->disk=disk;
+  fs_lock_init(&cache->lock);
+  fs_lock(&caches_lock);
+  cache->next=caches;
+  caches=cache;
+  fs_unlock(&caches_lock);
+  return cache;
+}
+
+// writes back and frees 'cache'.  The caller has made its disk current.
+// A thread still using it goes back to the default cache.
+int free_block_cache(BlockCache cache) {
+  BlockCacheInternals *saved=bc, **p;
+  int ret;
+
+  if (! cache || cache == &default_bc) {
+    return 1;
+  }
+  fs_lock(&caches_lock);
+  for (p=&caches; *p != cache; p=&(*p)->next) {
+  }
+  *p=cache->next;
+  fs_unlock(&caches_lock);
+
+  bc=cache;
+  fs_lock(&bc->lock);
+  ret=! bc->initialized || flush_cache();
+  release_cache();
+  fs_unlock(&bc->lock);
+  bc=saved == cache ? &default_bc : saved;
+  fs_lock_destroy(&cache->lock);
+  free(cache);
+  return ret;
+}
+
+// makes 'cache' the one the calling thread's calls act on, NULL for the
+// default cache.  Returns the cache used until now.
+BlockCache use_block_cache(BlockCache cache) {
+  BlockCacheInternals *prev=bc;
+  bc=cache ? cache : &default_bc;
+  return prev;
+}
+
+// (re)initializes the cache to hold 'nblocks' blocks using replacement
+// policy 'policy'.  Returns 1 on success, otherwise 0.
+int init_block_cache(unsigned long nblocks, BCPolicy policy) {
+  int ret;
+
+  fs_lock(&bc->lock);
+  ret=init_cache(nblocks, policy);
+  fs_unlock(&bc->lock);
+  return ret;
+}
+
+// reads block 'blocknum' into 'buf', from the cache if possible.
+int read_cached_block(void *buf, unsigned long blocknum) {
+  int ret;
+
+  fs_lock(&bc->lock);
+  ret=read_block(buf, blocknum);
+  fs_unlock(&bc->lock);
+  return ret;
+}
+
+// writes 'buf' to block 'blocknum', marking it dirty in the cache.
+int write_cached_block(void *buf, unsigned long blocknum) {
+  int ret;
+
+  fs_lock(&bc->lock);
+  ret=write_block(buf, blocknum);
+  fs_unlock(&bc->lock);
+  return ret;
+}
+
+// pins block 'blocknum' in the cache and returns its cached copy, read
+// in first if 'fill' is set.  Returns NULL if the cache is disabled,
+// every slot is pinned or the block can't be read.
+void *pin_cached_block(unsigned long blocknum, int fill) {
+  void *block=NULL;
+  long s;
+
+  fs_lock(&bc->lock);
+  if (ensure_init() && bc->nslots > 0 && blocknum < disk_blocks()) {
+    s=get_slot(blocknum, fill);
+    if (s != NO_SLOT && s != ALL_PINNED) {
+      bc->slots[s].pins++;
+      block=bc->slots[s].data;
+      sderror=SD_NONE;
+    }
+  }
+  fs_unlock(&bc->lock);
+  return block;
+}
+
+// drops a pin taken by pin_cached_block(), marking the block dirty if
+// the caller changed it.
+void unpin_cached_block(void *block, int dirty) {
+  long s;
+
+  fs_lock(&bc->lock);
+  s=((char *)block - bc->data) / SOFTWARE_DISK_BLOCK_SIZE;
+  bc->slots[s].pins--;
+  if (dirty) {
+    bc->slots[s].dirty=1;
+  }
+  fs_unlock(&bc->lock);
+}
+
+// scatter read of 'count' blocks.  Cached blocks are copied out of the
+// cache; the rest are fetched with one readv_sd_blocks() call and are not
+// inserted, so large streams don't push metadata out of the cache.  The
+// fetch happens outside the cache lock so other threads aren't held up.
+int readv_cached_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+  void **missbufs;
+  unsigned long *missnums;
+  unsigned long i, nmiss=0;
+  long s;
+  int ret;
+
+  fs_lock(&bc->lock);
+  if (! ensure_init()) {
+    fs_unlock(&bc->lock);
+    return 0;
+  }
+  if (bc->nslots == 0) {
+    bc->stats.misses+=count;
+    fs_unlock(&bc->lock);
+    return readv_sd_blocks(bufs, blocknums, count);
+  }
+
+  missbufs=malloc(count * sizeof(void *));
+  missnums=malloc(count * sizeof(unsigned long));
+  if (! missbufs || ! missnums) {
+    fs_unlock(&bc->lock);
+    free(missbufs);
+    free(missnums);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  for (i=0; i < count; i++) {
+    s=lookup_slot(blocknums[i]);
+    if (s != NO_SLOT) {
+      bc->stats.hits++;
+      touch_slot(s);
+      memcpy(bufs[i], bc->slots[s].data, SOFTWARE_DISK_BLOCK_SIZE);
+    }
+    else {
+      bc->stats.misses++;
+      missbufs[nmiss]=bufs[i];
+      missnums[nmiss]=blocknums[i];
+      nmiss++;
+    }
+  }
+  fs_unlock(&bc->lock);
+  sderror=SD_NONE;
+  ret=nmiss == 0 || readv_sd_blocks(missbufs, missnums, nmiss);
+  free(missbufs);
+  free(missnums);
+  return ret;
+}
+
+// gather write of 'count' blocks, written straight through to the software
+// disk with one writev_sd_blocks() call.  Copies already in the cache are
+// refreshed and made clean under the lock before the write goes out, so a
+// flush running alongside it can't put an older dirty copy over the new
+// blocks.  If the write fails they are left dirty to be written again.
+int writev_cached_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+  unsigned long i;
+  long s;
+
+  fs_lock(&bc->lock);
+  if (! ensure_init()) {
+    fs_unlock(&bc->lock);
+    return 0;
+  }
+  for (i=0; i < count && bc->nslots > 0; i++) {
+    s=lookup_slot(blocknums[i]);
+    if (s != NO_SLOT) {
+      memcpy(bc->slots[s].data, bufs[i], SOFTWARE_DISK_BLOCK_SIZE);
+      bc->slots[s].dirty=0;
+    }
+  }
+  fs_unlock(&bc->lock);
+  if (writev_sd_blocks(bufs, blocknums, count)) {
+    return 1;
+  }
+
+  fs_lock(&bc->lock);
+  for (i=0; i < count && bc->nslots > 0; i++) {
+    s=lookup_slot(blocknums[i]);
+    if (s != NO_SLOT) {
+      bc->slots[s].dirty=1;
+    }
+  }
+  fs_unlock(&bc->lock);
+  return 0;
+}
+
+// writes every dirty block back to the software disk.
+int flush_block_cache(void) {
+  int ret;
+
+  fs_lock(&bc->lock);
+  ret=flush_cache();
+  fs_unlock(&bc->lock);
+  return ret;
+}
+
+// forgets every cached block, dirty or not, and the disk's size, for when
+// the software disk has been reformatted underneath the cache.
+void invalidate_block_cache(void) {
+  unsigned long i;
+
+  fs_lock(&bc->lock);
+  for (i=0; i < bc->nbuckets; i++) {
+    bc->buckets[i]=NO_SLOT;
+  }
+  for (i=0; i < bc->nused; i++) {
+    bc->slots[i].valid=bc->slots[i].dirty=bc->slots[i].referenced=0;
+    bc->slots[i].pins=0;
+    bc->slots[i].prev=bc->slots[i].next=bc->slots[i].hash_next=NO_SLOT;
+  }
+  bc->nused=0;
+  bc->head=bc->tail=NO_SLOT;
+  bc->hand=0;
+  bc->disk_blocks=0;
+  fs_unlock(&bc->lock);
+}
+
+// copies the current cache counters into 'stats'.
+void get_block_cache_stats(BCStats *stats) {
+  fs_lock(&bc->lock);
+  *stats=bc->stats;
+  fs_unlock(&bc->lock);
+}
+
+// zeroes the cache counters.
+void reset_block_cache_stats(void) {
+  fs_lock(&bc->lock);
+  bzero(&bc->stats, sizeof(bc->stats));
+  fs_unlock(&bc->lock);
+}
+
+// prints the cache counters to standard output.
+void bc_print_stats(void) {
+  unsigned long lookups=bc->stats.hits + bc->stats.misses;
+  printf("BC: %lu blocks (%s), %lu hits, %lu misses (%.1f%% hit rate), "
+         "%lu evictions, %lu writebacks.\n",
+         bc->nslots, bc->policy == BC_LRU ? "LRU" : "CLOCK",
+         bc->stats.hits, bc->stats.misses,
+         lookups ? 100.0 * bc->stats.hits / lookups : 0.0,
+         bc->stats.evictions, bc->stats.writebacks);
+}
@@ -0,0 +1,119 @@
+//
+// Write-back block cache layered over the software disk for the LSU 4103
+// filesystem assignment.  The filesystem reads and writes metadata and data
+// blocks through this layer instead of calling read_sd_block/write_sd_block
+// directly.
+//
+
+#if ! defined(__BLOCKCACHE_4103_H__)
+#define __BLOCKCACHE_4103_H__
+
+#include "softwaredisk.h"
+
+// default cache size in blocks, used if the cache is touched before
+// init_block_cache() is called
+#define DEFAULT_CACHE_BLOCKS 64
+
+// replacement policy for the block cache
+typedef enum {
+  BC_LRU, BC_CLOCK
+} BCPolicy;
+
+// counters maintained by the block cache, useful for sizing it
+typedef struct BCStats {
+  unsigned long hits;        // lookups satisfied from the cache
+  unsigned long misses;      // lookups that had to go to the software disk
+  unsigned long evictions;   // valid blocks pushed out to make room
+  unsigned long writebacks;  // dirty blocks written to the software disk
+} BCStats;
+
+// a block cache of one software disk.  Each thread's calls act on the
+// one it last selected with use_block_cache(), initially the default
+// cache of the default disk; the thread's current software disk must be
+// the cache's own.
+struct BlockCacheInternals;
+typedef struct BlockCacheInternals *BlockCache;
+
+// function prototypes for block cache API
+
+// makes a cache for 'disk' (NULL for the default disk) of
+// DEFAULT_CACHE_BLOCKS blocks, set up the first time it is used.  Every
+// cache is written back at exit.  Returns NULL if out of memory.
+BlockCache new_block_cache(SoftwareDisk disk);
+
+// writes back and frees 'cache', whose disk must be the calling thread's
+// current one.  The default cache can't be freed.  Returns 1 on success,
+// otherwise 0.
+int free_block_cache(BlockCache cache);
+
+// makes 'cache' the one the calling thread's calls act on; NULL selects
+// the default cache.  Returns the cache used until now, so it can be
+// restored.
+BlockCache use_block_cache(BlockCache cache);
+
+// (re)initializes the cache to hold 'nblocks' blocks using replacement
+// policy 'policy'.  Any dirty blocks in an existing cache are written back
+// first.  An 'nblocks' of 0 disables caching, so every call goes straight
+// to the software disk.  No blocks may be pinned.  Returns 1 on success,
+// otherwise 0.
+int init_block_cache(unsigned long nblocks, BCPolicy policy);
+
+// reads block 'blocknum' into 'buf' (of size SOFTWARE_DISK_BLOCK_SIZE),
+// from the cache if possible.  Returns 1 on success or 0 on failure, in
+// which case 'sderror' describes the problem.
+int read_cached_block(void *buf, unsigned long blocknum);
+
+// writes 'buf' (of size SOFTWARE_DISK_BLOCK_SIZE) to block 'blocknum'.
+// The block is only marked dirty in the cache; it reaches the software
+// disk on eviction or flush_block_cache().  Returns 1 on success or 0 on
+// failure, in which case 'sderror' describes the problem.
+int write_cached_block(void *buf, unsigned long blocknum);
+
+// pins block 'blocknum' in the cache and returns a pointer to its cached
+// copy of SOFTWARE_DISK_BLOCK_SIZE bytes, which stays put until the pin
+// is dropped with unpin_cached_block().  The block is read in first if
+// 'fill' is set; otherwise the caller must overwrite all of it.  Returns
+// NULL if the block can't be pinned, as when caching is disabled or every
+// slot is pinned already; read_cached_block() and write_cached_block()
+// still work then.  Pins are cheap but hold a slot, so they should be
+// dropped as soon as possible.
+void *pin_cached_block(unsigned long blocknum, int fill);
+
+// drops a pin taken by pin_cached_block() on the cache it was taken from.
+// A nonzero 'dirty' marks the block as changed through the pointer, so
+// it is written back like a block passed to write_cached_block().  A
+// flush can write the block back while it is pinned, so changes made
+// through the pointer must not race with flush_block_cache().
+void unpin_cached_block(void *block, int dirty);
+
+// scatter read of 'count' blocks: block 'blocknums[i]' into 'bufs[i]'.
+// Cached blocks are served from the cache and the rest are read with a
+// single vectored call without being added to the cache.  Returns 1 on
+// success or 0 on failure.
+int readv_cached_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+
+// gather write of 'count' blocks: 'bufs[i]' to block 'blocknums[i]'.  The
+// blocks are written through to the software disk with a single vectored
+// call and any cached copies are updated.  Returns 1 on success or 0 on
+// failure.
+int writev_cached_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+
+// writes every dirty block back to the software disk.  Returns 1 on
+// success or 0 on failure.
+int flush_block_cache(void);
+
+// forgets every cached block without writing dirty ones back, and the
+// size of the disk.  Call this when reformatting or resizing the software
+// disk, with no blocks pinned.
+void invalidate_block_cache(void);
+
+// copies the current cache counters into 'stats'.
+void get_block_cache_stats(BCStats *stats);
+
+// zeroes the cache counters.
+void reset_block_cache_stats(void);
+
+// prints the cache counters to standard output.
+void bc_print_stats(void);
+
+#endif
@@ -1,448 +1,3159 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "softwaredisk.h"
+#include "blockcache.h"
+#include "sdasync.h"
 #include "filesystem.h"
 
-FSError fserror = FS_NONE;
+FS_THREAD_LOCAL FSError fserror = FS_NONE;
 
-#define MAX_FILES 512
-#define DATA_BITMAP_BLOCK 0
-#define INODE_BITMAP_BLOCK 1
-#define FIRST_INODE_BLOCK 2
-#define LAST_INODE_BLOCK 5  //128 inodes per block, max of 4*128 = 512 inodes, thus 512 files
+//the layout is derived at mount from the superblock in block 0, which
+//format_fs() writes.  In order the disk holds the superblock, the inode
+//bitmap, the data bitmap, the inode table, the directory, the journal and
+//the data blocks.  Everything before the journal is metadata, held in
+//memory while mounted.
+#define SUPERBLOCK_BLOCK 0
+#define FS_MAGIC 0x46533431 // "FS41"
+#define FS_VERSION 4        // 1 had fixed blocks 0-69 and 16-bit block numbers,
+                            // 2 had no double indirect extent blocks, 3 no inline files
 
-#define INODES_PER_BLOCK 128
-#define FIRST_DIR_ENTRY_BLOCK 6
-#define LAST_DIR_ENTRY_BLOCK 69
-#define DIR_ENTRIES_PER_BLOCK 8 //8 DE per block, max of 64*8 = 512 directory entries
-                                //corresponding to max file for single-level dir structure
+#define DEFAULT_MAX_FILES 512 // files on a disk formatted at mount
+#define BITS_PER_BLOCK (SOFTWARE_DISK_BLOCK_SIZE * 8)
+#define INODES_PER_BLOCK (SOFTWARE_DISK_BLOCK_SIZE / sizeof(Inode))
+#define DIR_ENTRIES_PER_BLOCK (SOFTWARE_DISK_BLOCK_SIZE / sizeof(DirectoryEntry))
+
+//the journal holds the last committed transaction: a header block
+//followed by copies of the metadata blocks it changed
+#define JOURNAL_MAGIC 0x4a343130 // "J410"
+#define JOURNAL_HEADER_WORDS 4
+#define MAX_JOURNAL_BLOCKS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint32_t) - JOURNAL_HEADER_WORDS)
 
-#define FIRST_DATA_BLOCK 70
-#define LAST_DATA_BLOCK 4095
 #define MAX_FILENAME_SIZE 507
-#define NUM_DIRECT_INODE_BLOCKS 13 // data blocks the innodes map to
-#define NUM_SINGLE_INDIRECT_INODE_BLOCKS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint16_t))
+#define NUM_DIRECT_EXTENTS 5 // extents held in the inode itself
+#define NUM_INDIRECT_EXTENTS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(Extent))
+#define NUM_LEAF_BLOCKS (SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint32_t))
+#define FIRST_LEAF_EXTENT (NUM_DIRECT_EXTENTS + NUM_INDIRECT_EXTENTS)
+#define MAX_EXTENTS (FIRST_LEAF_EXTENT + NUM_LEAF_BLOCKS * NUM_INDIRECT_EXTENTS)
+#define INITIAL_EXTENTS 16 // extent table entries allocated when a file is opened
+#define INODE_INLINE 1 // inode flag: the file's data is in its directory entry
+
+#define MAX_VECTOR_BLOCKS 256 // whole blocks moved per vectored request
+#define DEFAULT_READ_AHEAD_BLOCKS 8 // read-ahead window of a newly opened file
+#define WRITE_BUFFER_BLOCKS 16 // partially written blocks buffered per file
+
+//extents are only limited by the data blocks on the disk
+#define MAX_FILE_SIZE ((uint64_t)fs->geo.num_data_blocks * SOFTWARE_DISK_BLOCK_SIZE)
+
+//on-disk superblock.  Everything else about the layout is derived from it.
+typedef struct Superblock {
+    uint32_t magic;                           //FS_MAGIC
+    uint32_t version;                         //FS_VERSION
+    uint32_t block_size;                      //SOFTWARE_DISK_BLOCK_SIZE when formatted
+    uint32_t num_blocks;                      //blocks on the disk
+    uint32_t max_files;                       //inodes, and directory entries
+} Superblock;
+
+typedef union SuperblockBlock {
+    Superblock super;
+    uint8_t bytes[SOFTWARE_DISK_BLOCK_SIZE];
+} SuperblockBlock;
+
+//layout of a mounted filesystem, derived from its superblock
+typedef struct Geometry {
+    uint32_t num_blocks;                      //blocks on the disk
+    uint32_t max_files;                       //inodes, and directory entries
+    uint32_t inode_bitmap;                    //first inode bitmap block
+    uint32_t data_bitmap;                     //first data bitmap block
+    uint32_t num_data_bitmap_blocks;
+    uint32_t first_inode_block;
+    uint32_t num_inode_blocks;
+    uint32_t first_dir_block;
+    uint32_t num_dir_blocks;
+    uint32_t num_metadata_blocks;             //superblock through directory
+    uint32_t first_journal_block;             //journal header
+    uint32_t journal_capacity;                //block copies the journal holds
+    uint32_t first_data_block;
+    uint32_t num_data_blocks;
+    uint32_t hash_buckets;                    //name index chains, a power of 2 >= max_files
+} Geometry;
+
+//struct for a run of contiguous data blocks, or for a hole: blocks that
+//were skipped over and read as zeros without taking any space
+typedef struct Extent {
+    uint32_t start;                           //first data block, 0 for a hole
+    uint32_t length;                          //number of blocks
+} Extent;
+
+//struct for indirect block, holds extents past the direct ones.  Leaf
+//blocks under the double indirect block have the same layout.
+typedef struct IndirectBlock {
+    Extent extents[NUM_INDIRECT_EXTENTS];
+} IndirectBlock;
+
+//struct for double indirect block, lists the leaf blocks holding the
+//extents past the indirect block, NUM_INDIRECT_EXTENTS to a leaf
+typedef struct LeafList {
+    uint32_t blocks[NUM_LEAF_BLOCKS];
+} LeafList;
+
+//struct for inode.  Extents map the file's blocks in order starting at
+//logical block 0: the direct ones first, then the indirect block, then
+//the leaves of the double indirect block.  A small file is stored inline
+//instead, in its directory entry, and has no extents.
+typedef struct Inode {
+    uint64_t file_size;                       //file size
+    Extent extents[NUM_DIRECT_EXTENTS];       //direct extents
+    uint32_t num_extents;                     //extents in use, all levels
+    uint32_t indirect;                        //indirect extent block, 0 if none
+    uint32_t double_indirect;                 //leaf list block, 0 if none
+    uint32_t flags;                           //INODE_INLINE
+} Inode;
+
+//struct for a block on inodes
+typedef struct InodeBlock {
+    Inode inodes[INODES_PER_BLOCK];
+} InodeBlock;
+
+//struct for directory entries
+typedef struct DirectoryEntry {
+    uint32_t inode_index;                    //inode index
+    uint8_t open;                            //is the file open?
+    char file_name[MAX_FILENAME_SIZE];       //NULL term ASCII filename, then the
+                                             //data of an inline file.
+                                             //free if first character of filename is null
+} DirectoryEntry;
+
+//header block of a journal transaction.  The checksum covers the header
+//fields and every block copy, so a torn write is never replayed.
+typedef struct JournalHeader {
+    uint32_t magic;                          //JOURNAL_MAGIC if a transaction was committed
+    uint32_t sequence;                       //transactions committed so far
+    uint32_t checksum;                       //FNV-1a over sequence, count, blocks and copies
+    uint32_t count;                          //metadata blocks in the transaction
+    uint32_t blocks[MAX_JOURNAL_BLOCKS];     //home block of each copy
+} JournalHeader;
+
+typedef union JournalBlock {
+    JournalHeader header;
+    uint8_t bytes[SOFTWARE_DISK_BLOCK_SIZE];
+} JournalBlock;
+
+//typedef for a single block bitmap, structure must be size of one block.
+//Bit i is bit i%8 of byte i/8, which on little-endian hosts is also bit
+//i%64 of word i/64, so the allocator can work a word at a time.
+typedef union Bitmap {
+    uint8_t bytes[SOFTWARE_DISK_BLOCK_SIZE];
+    uint64_t words[SOFTWARE_DISK_BLOCK_SIZE / sizeof(uint64_t)];
+} Bitmap;
+
+//in-memory state for allocating from a bitmap spanning one or more blocks
+typedef struct BitAllocator {
+    uint64_t *words;                        //copy of the bitmap blocks
+    uint32_t block;                         //block # the bitmap starts at
+    uint64_t nbits;                         //number of usable bits
+    uint64_t nfree;                         //number of clear usable bits
+    uint64_t hint;                          //every word below this is full
+    FSLock lock;                            //guards the allocator when shared
+} BitAllocator;
+
+//position of a walk through a file's extents, so sequential block lookups
+//don't have to search the extent table
+typedef struct ExtentCursor {
+    uint32_t extent;                        //extent of the last lookup
+    uint32_t start;                         //first logical block of that extent
+} ExtentCursor;
+
+//struct for main file tyoe
+typedef struct FileInternals {
+    uint64_t position;                      //current file position
+    FileMode mode;                          //access mode
+    Inode inode;                            //inode
+    DirectoryEntry dir;                     //directory entry, and inline data
+    uint32_t dir_index;                     //index of directory entry
+    Extent *extents;                        //every extent, direct ones first
+    uint32_t *extent_starts;                //logical block each extent starts at
+    uint32_t extents_cap;                   //entries allocated in both tables
+    LeafList *leaves;                       //double indirect block, NULL if none
+    uint32_t nblocks;                       //data blocks mapped by the extents
+    ExtentCursor cursor;                    //walk used by read_file/write_file
+    int extents_dirty;                      //extents changed since last stored
+    uint32_t dirty_extent;                  //first extent changed since last stored
+    int leaves_dirty;                       //leaf list changed since last stored
+    int inline_dirty;                       //inline data or inode changed since written back
+    uint32_t ra_window;                     //blocks to read ahead, 0 disables
+    char *ra_buf;                           //read-ahead blocks, ra_window of them
+    uint32_t ra_start;                      //first logical block in ra_buf
+    uint32_t ra_count;                      //blocks held in ra_buf
+    uint32_t ra_last;                       //last block served from ra_buf
+    uint64_t ra_next;                       //position a sequential read starts at
+    ReadAheadStats ra_stats;                //read-ahead counters
+    char *ra_ahead_buf;                     //next window, being prefetched
+    SDRequest *ra_reqs;                     //requests filling ra_ahead_buf
+    uint32_t ra_nreqs;                      //requests in flight
+    uint32_t ra_ahead_start;                //first logical block of next window
+    uint32_t ra_ahead_count;                //blocks in next window, 0 if none
+    char *wb_buf;                           //dirty partial blocks, WRITE_BUFFER_BLOCKS of them
+    uint32_t wb_blocks[WRITE_BUFFER_BLOCKS];//logical block held in each wb_buf slot
+    uint32_t wb_count;                      //slots in use
+    struct FileInternals *next_open;        //next file in the open file list
+    struct FSState *fs;                     //filesystem the file is on
+} FileInternals;
+
+//in-memory index of the directory: filename -> directory entry
+typedef struct DirIndex {
+    int32_t *buckets;                       //first entry in each hash chain
+    int32_t *next;                          //next entry in the same chain
+} DirIndex;
+
+//group commit settings and counters
+typedef struct GroupCommit {
+    uint32_t max_ops;                       //commit once this many operations are pending, 0 for no limit
+    uint64_t max_usecs;                     //commit once the oldest has waited this long, 0 for no limit
+    uint32_t pending_ops;                   //operations since the last commit
+    uint64_t first_pending;                 //when the oldest of them happened
+    CommitStats stats;
+} GroupCommit;
+
+//room to build or replay one journal transaction, big enough for the
+//journal block and the copies it describes
+typedef struct JournalScratch {
+    JournalBlock journal;
+    void *bufs[1 + MAX_JOURNAL_BLOCKS];
+    unsigned long blocknums[1 + MAX_JOURNAL_BLOCKS];
+} JournalScratch;
+
+//in-memory state of one filesystem image.  mount_fs() loads every
+//metadata block once; all metadata operations then work on these copies,
+//which are written back by sync_fs() and unmount_fs().
+//
+//The locks matter in the thread-safe build.  They are always taken in
+//this order: mount_lock, dir_lock, one inode lock, inode_alloc.lock,
+//data_alloc.lock, meta_lock.  dir_lock covers the directory, its name
+//index and the open file list; an inode lock covers an open file and its
+//data blocks and is only shared by pread_file() callers; meta_lock covers
+//the in-memory inode table.  Each lock also covers the dirty flags of the
+//blocks it guards, and dir_lock covers 'group'.
+typedef struct FSState {
+    int mounted;                            //metadata is loaded
+    File open_list;                         //files currently open
+    SuperblockBlock super;
+    Geometry geo;                           //layout, derived from 'super'
+    InodeBlock *inode_blocks;               //geo.num_inode_blocks of them
+    DirectoryEntry *dir_entries;            //geo.num_dir_blocks blocks of them
+    uint8_t *dirty;                         //metadata block changed since written back
+    uint32_t journal_sequence;              //sequence of the last committed transaction
+    int checkpoint_unsynced;                //home blocks written since the last disk sync
+    GroupCommit group;
+    JournalScratch scratch;                 //used by commits and replay
+    DirIndex dir_index;
+    BitAllocator data_alloc;                //data bitmap, bit i is geo.first_data_block + i
+    BitAllocator inode_alloc;               //inode bitmap, bit i is inode i
+    FSLock mount_lock;
+    FSLock dir_lock;
+    FSLock meta_lock;
+    FSRWLock *inode_locks;                  //one per inode
+    SoftwareDisk disk;                      //NULL for the default disk
+    BlockCache cache;                       //NULL for the default cache
+    struct FSState *next;                   //next in 'instances'
+} FSState;
+
+//the filesystem in sdprivate.sd, used until a thread picks another
+static FSState default_fs = {
+    .data_alloc = { .lock = FS_LOCK_INITIALIZER },
+    .inode_alloc = { .lock = FS_LOCK_INITIALIZER },
+    .mount_lock = FS_LOCK_INITIALIZER,
+    .dir_lock = FS_LOCK_INITIALIZER,
+    .meta_lock = FS_LOCK_INITIALIZER
+};
+
+//the filesystem the calling thread's calls act on
+static FS_THREAD_LOCAL FSState *fs = &default_fs;
+
+//every filesystem, so all of them are written back at exit
+static FSState *instances = &default_fs;
+static FSLock instances_lock = FS_LOCK_INITIALIZER;
+
+static char zero_block[SOFTWARE_DISK_BLOCK_SIZE]; //what a hole reads as
+
+
+//set up allocator 'a' for the bitmap already loaded into a->words, which
+//starts at block 'block' and has 'nbits' usable bits.  Counts the free bits
+//and resets the search hint.
+static void init_bit_allocator(BitAllocator *a, uint32_t block, uint64_t nbits)
+{
+    a->block = block;
+    a->nbits = nbits;
+    a->nfree = 0;
+    a->hint = 0;
+    for(uint64_t w = 0; w * 64 < nbits; w++)
+    {
+        uint64_t used = a->words[w];
+        if(nbits - w * 64 < 64)
+        {
+            //bits past the end are never free
+            used |= ~0ULL << (nbits - w * 64);
+        }
+        a->nfree += 64 - __builtin_popcountll(used);
+    }
+}
+
+//return the index of the first free bit, or -1 if the bitmap is full
+static int64_t find_free_bit(BitAllocator *a)
+{
+    if(a->nfree == 0)
+    {
+        return -1;
+    }
+    uint64_t nwords = (a->nbits + 63) / 64;
+    for(uint64_t w = a->hint; w < nwords; w++)
+    {
+        uint64_t free_bits = ~a->words[w];
+        if(w == nwords - 1 && a->nbits % 64 != 0)
+        {
+            free_bits &= (1ULL << (a->nbits % 64)) - 1;
+        }
+        if(free_bits != 0)
+        {
+            a->hint = w;
+            return w * 64 + __builtin_ctzll(free_bits);
+        }
+    }
+    return -1;
+}
+
+//find a free bit, mark it as used and return its index.  Returns -1 if the
+//bitmap is full.
+int64_t allocate_bit(BitAllocator *a)
+{
+    int64_t index = find_free_bit(a);
+    if(index >= 0)
+    {
+        a->words[index / 64] |= 1ULL << (index % 64); //set bit in bitmap
+        a->nfree--;
+    }
+    return index;
+}
+
+//allocate up to 'want' consecutive bits, starting at 'goal' if that bit is
+//free and otherwise at the first free bit.  Returns the first bit and sets
+//'*got' to the length of the run, or returns -1 if the bitmap is full.
+int64_t allocate_run(BitAllocator *a, int64_t goal, uint64_t want, uint64_t *got)
+{
+    int64_t start;
+    if(goal >= 0 && (uint64_t)goal < a->nbits
+       && !(a->words[goal / 64] & (1ULL << (goal % 64))))
+    {
+        start = goal;
+    }
+    else
+    {
+        start = find_free_bit(a);
+        if(start < 0)
+        {
+            return -1;
+        }
+    }
+
+    //extend the run over clear bits a word at a time
+    uint64_t end = start;
+    while(end < a->nbits && end - start < want)
+    {
+        uint64_t rest = a->words[end / 64] >> (end % 64);
+        uint64_t room = 64 - end % 64;
+        uint64_t run = rest == 0 ? room : (uint64_t)__builtin_ctzll(rest);
+        end += run;
+        if(run < room)
+        {
+            break;
+        }
+    }
+    if(end > a->nbits)
+    {
+        end = a->nbits;
+    }
+    if(end - start > want)
+    {
+        end = start + want;
+    }
+
+    for(uint64_t i = start; i < end; i++)
+    {
+        a->words[i / 64] |= 1ULL << (i % 64); //set bit in bitmap
+    }
+    a->nfree -= end - start;
+    *got = end - start;
+    return start;
+}
+
+//mark bit 'index' as used
+void used_bit(BitAllocator *a, int64_t index)
+{
+    uint64_t mask = 1ULL << (index % 64);
+    if(!(a->words[index / 64] & mask))
+    {
+        a->words[index / 64] |= mask; //set bit in bitmap
+        a->nfree--;
+    }
+}
+
+//mark bit 'index' as free
+void free_bit(BitAllocator *a, int64_t index)
+{
+    uint64_t mask = 1ULL << (index % 64);
+    if(a->words[index / 64] & mask)
+    {
+        a->words[index / 64] &= ~mask; //clear bit in bitmap
+        a->nfree++;
+        if((uint64_t)index / 64 < a->hint)
+        {
+            a->hint = index / 64;
+        }
+    }
+}
+
+//read inode 'index' from the in-memory inode table
+static void read_inode(uint32_t index, Inode *node)
+{
+    fs_lock(&fs->meta_lock);
+    *node = fs->inode_blocks[index / INODES_PER_BLOCK].inodes[index % INODES_PER_BLOCK];
+    fs_unlock(&fs->meta_lock);
+}
+
+//update inode 'index' in the in-memory inode table
+static void write_inode(uint32_t index, Inode *node)
+{
+    fs_lock(&fs->meta_lock);
+    fs->inode_blocks[index / INODES_PER_BLOCK].inodes[index % INODES_PER_BLOCK] = *node;
+    fs->dirty[fs->geo.first_inode_block + index / INODES_PER_BLOCK] = 1;
+    fs_unlock(&fs->meta_lock);
+}
+
+//directory entry 'index' in the in-memory directory
+static DirectoryEntry *dir_entry(uint32_t index)
+{
+    return &fs->dir_entries[index];
+}
+
+//FNV-1a hash of a filename
+static uint32_t hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for(; *name; name++)
+    {
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    }
+    return h;
+}
+
+//add directory entry 'index' to the name index
+static void dir_index_insert(uint32_t index)
+{
+    uint32_t b = hash_name(dir_entry(index)->file_name) & (fs->geo.hash_buckets - 1);
+    fs->dir_index.next[index] = fs->dir_index.buckets[b];
+    fs->dir_index.buckets[b] = index;
+}
+
+//unlink directory entry 'index' from the name index
+static void dir_index_remove(uint32_t index)
+{
+    int32_t *p = &fs->dir_index.buckets[hash_name(dir_entry(index)->file_name) & (fs->geo.hash_buckets - 1)];
+    while(*p != -1)
+    {
+        if((uint32_t)*p == index)
+        {
+            *p = fs->dir_index.next[index];
+            return;
+        }
+        p = &fs->dir_index.next[*p];
+    }
+}
+
+//update directory entry 'index' in the in-memory directory and the name
+//index.  The caller holds dir_lock, as for every directory helper.
+static void write_dir_entry(uint32_t index, DirectoryEntry *dir)
+{
+    DirectoryEntry *old = dir_entry(index);
+    int renamed = strcmp(old->file_name, dir->file_name) != 0;
+    if(renamed && old->file_name[0] != '\0')
+    {
+        dir_index_remove(index);
+    }
+    *old = *dir;
+    if(renamed && dir->file_name[0] != '\0')
+    {
+        dir_index_insert(index);
+    }
+    fs->dirty[fs->geo.first_dir_block + index / DIR_ENTRIES_PER_BLOCK] = 1;
+}
+
+//look 'name' up in the name index.  Returns 1 and fills in 'index' and
+//'dir' if found, otherwise 0.
+static int find_dir_entry(char *name, uint32_t *index, DirectoryEntry *dir)
+{
+    int32_t e = fs->dir_index.buckets[hash_name(name) & (fs->geo.hash_buckets - 1)];
+    for(; e != -1; e = fs->dir_index.next[e])
+    {
+        if(strcmp(dir_entry(e)->file_name, name) == 0)
+        {
+            *index = e;
+            *dir = *dir_entry(e);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//return the first unused directory entry, or geo.max_files if the
+//directory is full
+static uint32_t free_dir_entry(void)
+{
+    for(uint32_t e = 0; e < fs->geo.max_files; e++)
+    {
+        if(dir_entry(e)->file_name[0] == '\0')
+        {
+            return e;
+        }
+    }
+    return fs->geo.max_files;
+}
+
+//mark the blocks of 'a' holding bits 'first' to 'last' dirty
+static void dirty_bitmap(BitAllocator *a, uint64_t first, uint64_t last)
+{
+    for(uint64_t b = first / BITS_PER_BLOCK; b <= last / BITS_PER_BLOCK; b++)
+    {
+        fs->dirty[a->block + b] = 1;
+    }
+}
+
+//allocate a bit from 'a', marking its bitmap block dirty.  Returns the bit
+//index or -1 if the bitmap is full.
+static int64_t allocate_from_bitmap(BitAllocator *a)
+{
+    fs_lock(&a->lock);
+    int64_t index = allocate_bit(a);
+    if(index >= 0)
+    {
+        dirty_bitmap(a, index, index);
+    }
+    fs_unlock(&a->lock);
+    return index;
+}
+
+//clear bit 'index' in 'a', marking its bitmap block dirty
+static void release_to_bitmap(BitAllocator *a, int64_t index)
+{
+    fs_lock(&a->lock);
+    free_bit(a, index);
+    dirty_bitmap(a, index, index);
+    fs_unlock(&a->lock);
+}
+
+//allocate up to 'want' contiguous data blocks, preferably starting at data
+//block 'goal' (0 for no preference).  Returns the first block and sets
+//'*got', or returns 0 if the disk is full (fserror is set).
+static uint32_t allocate_data_run(uint32_t goal, uint32_t want, uint32_t *got)
+{
+    uint64_t n;
+    fs_lock(&fs->data_alloc.lock);
+    int64_t bit = allocate_run(&fs->data_alloc, goal ? (int64_t)goal - fs->geo.first_data_block : -1, want, &n);
+    if(bit >= 0)
+    {
+        dirty_bitmap(&fs->data_alloc, bit, bit + n - 1);
+    }
+    fs_unlock(&fs->data_alloc.lock);
+    if(bit < 0)
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    *got = n;
+    return fs->geo.first_data_block + bit;
+}
+
+//return 'count' data blocks starting at 'block' to the data bitmap
+static void free_data_run(uint32_t block, uint32_t count)
+{
+    if(count == 0)
+    {
+        return;
+    }
+    uint64_t first = block - fs->geo.first_data_block;
+    fs_lock(&fs->data_alloc.lock);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        free_bit(&fs->data_alloc, first + i);
+    }
+    dirty_bitmap(&fs->data_alloc, first, first + count - 1);
+    fs_unlock(&fs->data_alloc.lock);
+}
+
+//in-memory copy of metadata block 'b'
+static void *metadata_block(uint32_t b)
+{
+    if(b == SUPERBLOCK_BLOCK)
+    {
+        return &fs->super;
+    }
+    else if(b < fs->geo.data_bitmap)
+    {
+        return (char *)fs->inode_alloc.words + (uint64_t)(b - fs->geo.inode_bitmap) * SOFTWARE_DISK_BLOCK_SIZE;
+    }
+    else if(b < fs->geo.first_inode_block)
+    {
+        return (char *)fs->data_alloc.words + (uint64_t)(b - fs->geo.data_bitmap) * SOFTWARE_DISK_BLOCK_SIZE;
+    }
+    else if(b < fs->geo.first_dir_block)
+    {
+        return &fs->inode_blocks[b - fs->geo.first_inode_block];
+    }
+    return &fs->dir_entries[(uint64_t)(b - fs->geo.first_dir_block) * DIR_ENTRIES_PER_BLOCK];
+}
+
+//fold 'len' bytes at 'data' into FNV-1a hash 'h'
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for(size_t i = 0; i < len; i++)
+    {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+//checksum of the transaction described by 'header' with block copies
+//'copies'
+static uint32_t journal_checksum(JournalHeader *header, void **copies)
+{
+    uint32_t h = 2166136261u;
+    h = hash_bytes(h, &header->sequence, sizeof(header->sequence));
+    h = hash_bytes(h, &header->count, sizeof(header->count));
+    h = hash_bytes(h, header->blocks, header->count * sizeof(header->blocks[0]));
+    for(uint32_t i = 0; i < header->count; i++)
+    {
+        h = hash_bytes(h, copies[i], SOFTWARE_DISK_BLOCK_SIZE);
+    }
+    return h;
+}
+
+//monotonic clock in microseconds
+static uint64_t now_usecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//commit the 'n' metadata blocks in 'bufs[1..n]', whose homes are in
+//'journal', as one transaction: the header and block copies go out in
+//one sequential write, and only once that is on stable storage are the
+//blocks written to their homes.  'bufs[0]' and 'blocknums' are scratch
+//space for n + 1 entries.
+static int commit_transaction(JournalBlock *journal, void **bufs, unsigned long *blocknums, uint32_t n)
+{
+    journal->header.magic = JOURNAL_MAGIC;
+    journal->header.sequence = fs->journal_sequence + 1;
+    journal->header.count = n;
+    journal->header.checksum = journal_checksum(&journal->header, &bufs[1]);
+    bufs[0] = journal;
+    for(uint32_t i = 0; i <= n; i++)
+    {
+        blocknums[i] = fs->geo.first_journal_block + i;
+    }
+
+    //the previous checkpoint must be stable before its journal copy is
+    //overwritten
+    if(!(fs->checkpoint_unsynced ? sync_software_disk() : 1)
+       || !writev_cached_blocks(bufs, blocknums, 1 + n)
+       || !sync_software_disk())
+    {
+        return 0;
+    }
+    fs->journal_sequence++;
+    for(uint32_t i = 0; i < n; i++)
+    {
+        blocknums[i] = journal->header.blocks[i];
+    }
+    fs->checkpoint_unsynced = 1;
+    return writev_cached_blocks(&bufs[1], blocknums, n);
+}
+
+//write every dirty metadata block back through the journal.  File data
+//and indirect blocks are flushed first, so committed metadata never
+//points at blocks that haven't been written.  A write-back larger than
+//the journal is split over several transactions.  The caller holds
+//dir_lock.
+static int write_back_metadata(void)
+{
+    JournalBlock *journal = &fs->scratch.journal;
+    void **bufs = fs->scratch.bufs;
+    unsigned long *blocknums = fs->scratch.blocknums;
+    uint64_t start = now_usecs();
+    uint32_t n = 0, total = 0;
+    int ok = 1;
+
+    fs_lock(&fs->inode_alloc.lock);
+    fs_lock(&fs->data_alloc.lock);
+    fs_lock(&fs->meta_lock);
 
-#define MAX_FILE_SIZE (NUM_DIRECT_INODE_BLOCKS + NUM_SINGLE_INDIRECT_INODE_BLOCKS) * SOFTWARE_DISK_BLOCK_SIZE
+    bzero(journal, sizeof(*journal));
+    for(uint32_t b = 0; ok && b < fs->geo.num_metadata_blocks; b++)
+    {
+        if(fs->dirty[b])
+        {
+            if(total == 0)
+            {
+                ok = flush_block_cache();
+            }
+            journal->header.blocks[n] = b;
+            bufs[1 + n] = metadata_block(b);
+            n++;
+            total++;
+        }
+        if(ok && n > 0 && (n == fs->geo.journal_capacity || b == fs->geo.num_metadata_blocks - 1))
+        {
+            ok = commit_transaction(journal, bufs, blocknums, n);
+            bzero(journal, sizeof(*journal));
+            n = 0;
+        }
+    }
+    if(ok && total > 0)
+    {
+        bzero(fs->dirty, fs->geo.num_metadata_blocks);
+
+        uint64_t usecs = now_usecs() - start;
+        CommitStats *stats = &fs->group.stats;
+        stats->commits++;
+        stats->operations += fs->group.pending_ops;
+        stats->blocks += total;
+        stats->total_usecs += usecs;
+        if(fs->group.pending_ops > stats->max_batch)
+        {
+            stats->max_batch = fs->group.pending_ops;
+        }
+        if(usecs > stats->max_usecs)
+        {
+            stats->max_usecs = usecs;
+        }
+        fs->group.pending_ops = 0;
+    }
+    fs_unlock(&fs->meta_lock);
+    fs_unlock(&fs->data_alloc.lock);
+    fs_unlock(&fs->inode_alloc.lock);
+    return ok;
+}
+
+//count a metadata operation towards the group commit window and commit
+//once the window is full.  A failed commit leaves the metadata dirty for
+//the next one.  The caller holds dir_lock.
+static void note_metadata_op(void)
+{
+    uint64_t now = now_usecs();
+    if(fs->group.pending_ops++ == 0)
+    {
+        fs->group.first_pending = now;
+    }
+    if((fs->group.max_ops > 0 && fs->group.pending_ops >= fs->group.max_ops)
+       || (fs->group.max_usecs > 0 && now - fs->group.first_pending >= fs->group.max_usecs))
+    {
+        write_back_metadata();
+    }
+}
+
+//write the transaction left in the journal back to its home blocks.
+//Replaying a transaction that was already checkpointed rewrites the same
+//contents, so this is safe after a clean shutdown too.  Returns 1 unless
+//the disk fails or memory runs out.
+static int replay_journal(void)
+{
+    JournalBlock *journal = &fs->scratch.journal;
+    void **bufs = fs->scratch.bufs;
+    unsigned long *blocknums = fs->scratch.blocknums;
+
+    fs->journal_sequence = 0;
+    if(!read_sd_block(journal, fs->geo.first_journal_block))
+    {
+        return 0;
+    }
+    JournalHeader *header = &journal->header;
+    if(header->magic != JOURNAL_MAGIC || header->count == 0 || header->count > fs->geo.journal_capacity)
+    {
+        return 1;
+    }
+    char *copies = malloc((size_t)header->count * SOFTWARE_DISK_BLOCK_SIZE);
+    if(!copies)
+    {
+        return 0;
+    }
+    int ok = read_sd_blocks(copies, fs->geo.first_journal_block + 1, header->count);
+    for(uint32_t i = 0; ok && i < header->count; i++)
+    {
+        bufs[i] = copies + (size_t)i * SOFTWARE_DISK_BLOCK_SIZE;
+        blocknums[i] = header->blocks[i];
+        if(header->blocks[i] == SUPERBLOCK_BLOCK || header->blocks[i] >= fs->geo.num_metadata_blocks)
+        {
+            //not a transaction of this filesystem
+            free(copies);
+            return 1;
+        }
+    }
+    if(ok && journal_checksum(header, bufs) == header->checksum)
+    {
+        fs->journal_sequence = header->sequence;
+        ok = writev_cached_blocks(bufs, blocknums, header->count) && sync_software_disk();
+    }
+    //otherwise a torn commit; the previous transaction was already
+    //checkpointed
+    free(copies);
+    return ok;
+}
+
+//mount on first use for callers that don't call mount_fs() themselves
+static int ensure_mounted(void)
+{
+    if(mount_fs())
+    {
+        return 1;
+    }
+    fserror = FS_IO_ERROR;
+    return 0;
+}
+
+//block 'b' to read from: pinned in the block cache, or read into 'spare'
+//if the cache can't hold it.  Hand it back with put_block().  Returns
+//NULL with fserror set if the block can't be read.
+static void *get_block(uint32_t b, void *spare)
+{
+    void *block = pin_cached_block(b, 1);
+    if(block)
+    {
+        return block;
+    }
+    if(!read_cached_block(spare, b))
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    return spare;
+}
+
+//done with 'block' from get_block().  Blocks are only pinned for
+//reading: a flush can write a cached block back at any time, so new
+//contents still go in whole through write_cached_block().
+static void put_block(void *block, void *spare)
+{
+    if(block != spare)
+    {
+        unpin_cached_block(block, 0);
+    }
+}
+
+//load every extent of 'node' into 'extents', which has room for all of
+//them, and its leaf list into 'leaves' if it has one.  The leaves come in
+//with one vectored request per MAX_VECTOR_BLOCKS.
+static int load_extents(Inode *node, Extent *extents, LeafList *leaves)
+{
+    uint32_t num = node->num_extents;
+    uint32_t direct = num < NUM_DIRECT_EXTENTS ? num : NUM_DIRECT_EXTENTS;
+    memcpy(extents, node->extents, direct * sizeof(Extent));
+    if(num > NUM_DIRECT_EXTENTS)
+    {
+        IndirectBlock spare;
+        IndirectBlock *indirect = get_block(node->indirect, &spare);
+        if(!indirect)
+        {
+            return 0;
+        }
+        uint32_t n = num < FIRST_LEAF_EXTENT ? num : FIRST_LEAF_EXTENT;
+        memcpy(&extents[NUM_DIRECT_EXTENTS], indirect->extents, (n - NUM_DIRECT_EXTENTS) * sizeof(Extent));
+        put_block(indirect, &spare);
+    }
+    if(num > FIRST_LEAF_EXTENT)
+    {
+        if(!read_cached_block(leaves, node->double_indirect))
+        {
+            return 0;
+        }
+        uint32_t nleaves = (num - FIRST_LEAF_EXTENT + NUM_INDIRECT_EXTENTS - 1) / NUM_INDIRECT_EXTENTS;
+        void *bufs[MAX_VECTOR_BLOCKS];
+        unsigned long blocknums[MAX_VECTOR_BLOCKS];
+        for(uint32_t first = 0; first < nleaves; first += MAX_VECTOR_BLOCKS)
+        {
+            uint32_t n = 0;
+            for(uint32_t j = first; j < nleaves && n < MAX_VECTOR_BLOCKS; j++, n++)
+            {
+                bufs[n] = &extents[FIRST_LEAF_EXTENT + (uint64_t)j * NUM_INDIRECT_EXTENTS];
+                blocknums[n] = leaves->blocks[j];
+            }
+
+            //'extents' ends inside a partly used last leaf, so that one
+            //is copied out of the cache on its own
+            uint32_t used = num - FIRST_LEAF_EXTENT - (nleaves - 1) * NUM_INDIRECT_EXTENTS;
+            int partial = first + n == nleaves && used < NUM_INDIRECT_EXTENTS;
+            if(n - partial > 0 && !readv_cached_blocks(bufs, blocknums, n - partial))
+            {
+                return 0;
+            }
+            if(partial)
+            {
+                IndirectBlock spare;
+                IndirectBlock *last = get_block(blocknums[n - 1], &spare);
+                if(!last)
+                {
+                    return 0;
+                }
+                memcpy(bufs[n - 1], last->extents, used * sizeof(Extent));
+                put_block(last, &spare);
+            }
+        }
+    }
+    return 1;
+}
+
+//make room for 'want' extents in the extent table of 'file'.  Returns 1
+//on success.
+static int reserve_extents(File file, uint32_t want)
+{
+    if(want <= file->extents_cap)
+    {
+        return 1;
+    }
+    uint32_t cap = file->extents_cap ? file->extents_cap : INITIAL_EXTENTS;
+    while(cap < want)
+    {
+        cap *= 2;
+    }
+    Extent *extents = realloc(file->extents, (size_t)cap * sizeof(Extent));
+    if(!extents)
+    {
+        return 0;
+    }
+    file->extents = extents;
+    uint32_t *starts = realloc(file->extent_starts, (size_t)cap * sizeof(uint32_t));
+    if(!starts)
+    {
+        return 0;
+    }
+    file->extent_starts = starts;
+    file->extents_cap = cap;
+    return 1;
+}
+
+//release the extent table of 'file'
+static void free_extents(File file)
+{
+    free(file->extents);
+    free(file->extent_starts);
+    free(file->leaves);
+    file->extents = NULL;
+    file->extent_starts = NULL;
+    file->leaves = NULL;
+    file->extents_cap = 0;
+}
+
+//set up the in-memory block map of a newly opened 'file'.  The whole
+//extent table is resolved here, so lookups never go back to the indirect
+//blocks.
+static int open_extents(File file)
+{
+    file->extents = NULL;
+    file->extent_starts = NULL;
+    file->extents_cap = 0;
+    file->leaves = NULL;
+    file->nblocks = 0;
+    file->cursor.extent = 0;
+    file->cursor.start = 0;
+    file->extents_dirty = 0;
+    file->dirty_extent = file->inode.num_extents;
+    file->leaves_dirty = 0;
+    uint32_t num = file->inode.num_extents;
+    if(!reserve_extents(file, num > INITIAL_EXTENTS ? num : INITIAL_EXTENTS)
+       || (file->inode.double_indirect != 0 && !(file->leaves = malloc(sizeof(LeafList)))))
+    {
+        free_extents(file);
+        return 0;
+    }
+    if(!load_extents(&file->inode, file->extents, file->leaves))
+    {
+        free_extents(file);
+        return 0;
+    }
+    for(uint32_t i = 0; i < file->inode.num_extents; i++)
+    {
+        file->extent_starts[i] = file->nblocks;
+        file->nblocks += file->extents[i].length;
+    }
+    return 1;
+}
+
+//give 'file' the indirect, double indirect and leaf blocks a table of
+//'total' extents is stored in, so a full disk shows up while blocks are
+//being mapped rather than when the table is written back.  Returns 1 on
+//success, otherwise 0 with fserror set.
+static int reserve_extent_blocks(File file, uint32_t total)
+{
+    Inode *inode = &file->inode;
+    uint32_t got;
+    if(total > NUM_DIRECT_EXTENTS && inode->indirect == 0)
+    {
+        if((inode->indirect = allocate_data_run(0, 1, &got)) == 0)
+        {
+            return 0;
+        }
+        file->extents_dirty = 1;
+    }
+    if(total <= FIRST_LEAF_EXTENT)
+    {
+        return 1;
+    }
+    if(inode->double_indirect == 0)
+    {
+        if(!file->leaves && !(file->leaves = calloc(1, sizeof(LeafList))))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        if((inode->double_indirect = allocate_data_run(0, 1, &got)) == 0)
+        {
+            return 0;
+        }
+        file->extents_dirty = 1;
+        file->leaves_dirty = 1;
+    }
+
+    //leaves are used from the first on, so only the last can be missing
+    uint32_t nleaves = (total - FIRST_LEAF_EXTENT + NUM_INDIRECT_EXTENTS - 1) / NUM_INDIRECT_EXTENTS;
+    for(uint32_t j = nleaves; j > 0 && file->leaves->blocks[j - 1] == 0; j--)
+    {
+        if((file->leaves->blocks[j - 1] = allocate_data_run(0, 1, &got)) == 0)
+        {
+            return 0;
+        }
+        file->extents_dirty = 1;
+        file->leaves_dirty = 1;
+    }
+    return 1;
+}
+
+//write the extents of 'file' from 'file->dirty_extent' on back into its
+//inode and extent blocks, which reserve_extent_blocks() has allocated.
+//Returns 1 on success, otherwise 0 with fserror set.
+static int store_extents(File file)
+{
+    Inode *inode = &file->inode;
+    //an inline file has no extents, and its inode goes out with its data
+    if(inode->flags & INODE_INLINE)
+    {
+        return 1;
+    }
+    uint32_t num = inode->num_extents;
+    uint32_t from = file->dirty_extent;
+    if(!reserve_extent_blocks(file, num))
+    {
+        return 0;
+    }
+    uint32_t direct = num < NUM_DIRECT_EXTENTS ? num : NUM_DIRECT_EXTENTS;
+    memcpy(inode->extents, file->extents, direct * sizeof(Extent));
+
+    if(num > NUM_DIRECT_EXTENTS && from < FIRST_LEAF_EXTENT)
+    {
+        uint32_t n = num < FIRST_LEAF_EXTENT ? num : FIRST_LEAF_EXTENT;
+        IndirectBlock indirect;
+        memcpy(indirect.extents, &file->extents[NUM_DIRECT_EXTENTS], (n - NUM_DIRECT_EXTENTS) * sizeof(Extent));
+        bzero(&indirect.extents[n - NUM_DIRECT_EXTENTS], (FIRST_LEAF_EXTENT - n) * sizeof(Extent));
+        if(!write_cached_block(&indirect, inode->indirect))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    else if(num <= NUM_DIRECT_EXTENTS && inode->indirect != 0)
+    {
+        free_data_run(inode->indirect, 1);
+        inode->indirect = 0;
+    }
+
+    //rewrite the leaves from the one holding the first changed extent
+    uint32_t nleaves = num > FIRST_LEAF_EXTENT
+                       ? (num - FIRST_LEAF_EXTENT + NUM_INDIRECT_EXTENTS - 1) / NUM_INDIRECT_EXTENTS : 0;
+    uint32_t first = from > FIRST_LEAF_EXTENT ? (from - FIRST_LEAF_EXTENT) / NUM_INDIRECT_EXTENTS : 0;
+    for(uint32_t j = first; j < nleaves; j++)
+    {
+        uint64_t e = FIRST_LEAF_EXTENT + (uint64_t)j * NUM_INDIRECT_EXTENTS;
+        uint32_t n = num - e < NUM_INDIRECT_EXTENTS ? num - e : NUM_INDIRECT_EXTENTS;
+        IndirectBlock leaf;
+        memcpy(leaf.extents, &file->extents[e], n * sizeof(Extent));
+        bzero(&leaf.extents[n], (NUM_INDIRECT_EXTENTS - n) * sizeof(Extent));
+        if(!write_cached_block(&leaf, file->leaves->blocks[j]))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    if(file->leaves)
+    {
+        for(uint32_t j = nleaves; j < NUM_LEAF_BLOCKS && file->leaves->blocks[j] != 0; j++)
+        {
+            free_data_run(file->leaves->blocks[j], 1);
+            file->leaves->blocks[j] = 0;
+            file->leaves_dirty = 1;
+        }
+        //the list is only written to a block of its own, never block 0
+        if(nleaves == 0)
+        {
+            if(inode->double_indirect != 0)
+            {
+                free_data_run(inode->double_indirect, 1);
+                inode->double_indirect = 0;
+            }
+            free(file->leaves);
+            file->leaves = NULL;
+            file->leaves_dirty = 0;
+        }
+        else if(file->leaves_dirty)
+        {
+            if(!write_cached_block(file->leaves, inode->double_indirect))
+            {
+                fserror = FS_IO_ERROR;
+                return 0;
+            }
+            file->leaves_dirty = 0;
+        }
+    }
+    file->extents_dirty = 0;
+    file->dirty_extent = num;
+    write_inode(file->dir.inode_index, inode);
+    return 1;
+}
+
+//map logical block 'n' of 'file' to a data block, walking on from
+//'cursor'.  Returns 0 for a block that hasn't been allocated.  Only the
+//cursor is updated, so concurrent readers can each use their own.
+static uint32_t map_block(File file, ExtentCursor *cursor, uint32_t n)
+{
+    if(n >= file->nblocks)
+    {
+        return 0;
+    }
+    //lookups are mostly sequential, so try the last extent used and the
+    //one after it before searching the table
+    uint32_t e = cursor->extent;
+    if(n < cursor->start || n >= cursor->start + file->extents[e].length)
+    {
+        uint32_t num = file->inode.num_extents;
+        if(n >= cursor->start && e + 1 < num
+           && n < file->extent_starts[e + 1] + file->extents[e + 1].length)
+        {
+            e++;
+        }
+        else
+        {
+            //last extent starting at or before n
+            uint32_t lo = 0, hi = num - 1;
+            while(lo < hi)
+            {
+                uint32_t mid = lo + (hi - lo + 1) / 2;
+                if(file->extent_starts[mid] <= n)
+                {
+                    lo = mid;
+                }
+                else
+                {
+                    hi = mid - 1;
+                }
+            }
+            e = lo;
+        }
+        cursor->extent = e;
+        cursor->start = file->extent_starts[e];
+    }
+    if(file->extents[e].start == 0)
+    {
+        return 0;
+    }
+    return file->extents[e].start + (n - cursor->start);
+}
+
+//map logical block 'n' of 'file' using the file's own cursor
+static uint32_t file_block(File file, uint32_t n)
+{
+    return map_block(file, &file->cursor, n);
+}
+
+//1 if extent 'b' can be folded into extent 'a' just before it: both are
+//holes, or 'b' starts where 'a' ends on the disk
+static int extents_join(Extent *a, Extent *b)
+{
+    if((uint64_t)a->length + b->length > UINT32_MAX || (a->start == 0) != (b->start == 0))
+    {
+        return 0;
+    }
+    return a->start == 0 || a->start + a->length == b->start;
+}
+
+//map logical blocks 'n' .. 'n'+'count'-1 of 'file' to the data blocks
+//from 'start' on, or to a hole if 'start' is 0.  The range lies inside
+//one extent or starts at or past the end of the map; a gap between the
+//end of the map and 'n' becomes a hole.  Neighbouring extents that join
+//up are merged.  The old blocks of the range are the caller's to free.
+//Returns 1 on success, otherwise 0 with fserror set.
+static int remap_blocks(File file, uint32_t n, uint32_t count, uint32_t start)
+{
+    uint32_t num = file->inode.num_extents;
+    uint32_t lo, hi;                        //extents [lo, hi) are replaced
+    Extent pieces[5];
+    uint32_t np = 0;
+    if(n >= file->nblocks)
+    {
+        lo = hi = num;
+        if(n > file->nblocks)
+        {
+            pieces[np].start = 0;
+            pieces[np++].length = n - file->nblocks;
+        }
+        pieces[np].start = start;
+        pieces[np++].length = count;
+    }
+    else
+    {
+        //split the extent holding the range around it
+        file_block(file, n);
+        lo = file->cursor.extent;
+        hi = lo + 1;
+        Extent old = file->extents[lo];
+        uint32_t offset = n - file->cursor.start;
+        pieces[np].start = old.start;
+        pieces[np++].length = offset;
+        pieces[np].start = start;
+        pieces[np++].length = count;
+        pieces[np].start = old.start ? old.start + offset + count : 0;
+        pieces[np++].length = old.length - offset - count;
+    }
+
+    //take in the neighbours so they can merge with the new pieces
+    if(lo > 0)
+    {
+        lo--;
+        memmove(&pieces[1], &pieces[0], np * sizeof(Extent));
+        pieces[0] = file->extents[lo];
+        np++;
+    }
+    if(hi < num)
+    {
+        pieces[np++] = file->extents[hi++];
+    }
+    uint32_t m = 0;
+    for(uint32_t i = 0; i < np; i++)
+    {
+        if(pieces[i].length == 0)
+        {
+            continue;
+        }
+        if(m > 0 && extents_join(&pieces[m - 1], &pieces[i]))
+        {
+            pieces[m - 1].length += pieces[i].length;
+        }
+        else
+        {
+            pieces[m++] = pieces[i];
+        }
+    }
+
+    uint32_t total = num - (hi - lo) + m;
+    if(total > MAX_EXTENTS)
+    {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        return 0;
+    }
+    else if(!reserve_extents(file, total))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    else if(!reserve_extent_blocks(file, total))
+    {
+        return 0;
+    }
+    memmove(&file->extents[lo + m], &file->extents[hi], (num - hi) * sizeof(Extent));
+    memcpy(&file->extents[lo], pieces, m * sizeof(Extent));
+    file->inode.num_extents = total;
+    uint32_t next = lo > 0 ? file->extent_starts[lo - 1] + file->extents[lo - 1].length : 0;
+    for(uint32_t i = lo; i < total; i++)
+    {
+        file->extent_starts[i] = next;
+        next += file->extents[i].length;
+    }
+    file->nblocks = next;
+    file->cursor.extent = lo;
+    file->cursor.start = file->extent_starts[lo];
+    file->extents_dirty = 1;
+    if(lo < file->dirty_extent)
+    {
+        file->dirty_extent = lo;
+    }
+    return 1;
+}
+
+//give logical blocks 'first' .. 'first'+'count'-1 of 'file' data blocks
+//where they don't have them yet.  The caller is about to overwrite them
+//in full, so nothing is zero-filled, and skipped blocks before 'first'
+//stay a hole.  Returns how many blocks from 'first' on have data blocks,
+//which is less than 'count' if space ran out (fserror is set).
+static uint32_t allocate_blocks(File file, uint32_t first, uint32_t count)
+{
+    uint32_t done = 0;
+    while(done < count)
+    {
+        uint32_t n = first + done;
+        uint32_t want = count - done;
+        if(n < file->nblocks)
+        {
+            uint32_t block = file_block(file, n);
+            uint32_t left = file->cursor.start + file->extents[file->cursor.extent].length - n;
+            if(want > left)
+            {
+                want = left;
+            }
+            if(block != 0)
+            {
+                done += want;
+                continue;
+            }
+        }
+
+        //the new run goes right after the blocks before it, if it can
+        uint32_t goal = n > 0 ? file_block(file, n - 1) : 0;
+        if(goal != 0)
+        {
+            goal++;
+        }
+        if(goal >= fs->geo.num_blocks)
+        {
+            goal = 0;
+        }
+        uint32_t got;
+        uint32_t start = allocate_data_run(goal, want, &got);
+        if(start == 0)
+        {
+            break;
+        }
+        if(!remap_blocks(file, n, got, start))
+        {
+            free_data_run(start, got);
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+//start of the inline data of 'file', just past its name
+static char *inline_data(File file)
+{
+    return file->dir.file_name + strlen(file->dir.file_name) + 1;
+}
+
+//bytes of data 'file' can hold inline, which is what its name leaves of
+//the directory entry
+static uint64_t inline_capacity(File file)
+{
+    return MAX_FILENAME_SIZE - strlen(file->dir.file_name) - 1;
+}
+
+//move the data of inline 'file' into its first data block so the file
+//can grow past inline_capacity().  Data that is all zeros, as in an
+//empty file, becomes a hole instead.  Returns 1 on success, otherwise 0
+//with fserror set; running out of space leaves the file inline.
+static int spill_inline(File file)
+{
+    char block[SOFTWARE_DISK_BLOCK_SIZE];
+    uint32_t size = file->inode.file_size;
+    if(memcmp(inline_data(file), zero_block, size) == 0)
+    {
+        file->inode.flags &= ~INODE_INLINE;
+        file->inline_dirty = 0;
+        write_inode(file->dir.inode_index, &file->inode);
+        return 1;
+    }
+    memcpy(block, inline_data(file), size);
+    bzero(block + size, SOFTWARE_DISK_BLOCK_SIZE - size);
+    if(allocate_blocks(file, 0, 1) == 0)
+    {
+        return 0;
+    }
+
+    file->inode.flags &= ~INODE_INLINE;
+    file->inline_dirty = 0;
+    bzero(inline_data(file), inline_capacity(file));
+    int ok = write_cached_block(block, file_block(file, 0));
+    if(!ok)
+    {
+        fserror = FS_IO_ERROR;
+    }
+    return store_extents(file) && ok;
+}
+
+//read 'count' whole blocks of 'file', starting at logical block 'first',
+//straight into 'buf' with a single vectored request, mapping blocks with
+//'cursor'.  Blocks that were never written read as zeros.  Returns 1 on
+//success.
+static int read_block_run(File file, ExtentCursor *cursor, char *buf, uint32_t first, uint32_t count)
+{
+    void *bufs[MAX_VECTOR_BLOCKS];
+    unsigned long blocknums[MAX_VECTOR_BLOCKS];
+    unsigned long n = 0;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        char *dest = buf + (uint64_t)i * SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t block = map_block(file, cursor, first + i);
+        if(block == 0)
+        {
+            bzero(dest, SOFTWARE_DISK_BLOCK_SIZE);
+            continue;
+        }
+        bufs[n] = dest;
+        blocknums[n] = block;
+        n++;
+    }
+    if(n > 0 && !readv_cached_blocks(bufs, blocknums, n))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return 1;
+}
+
+//write 'count' whole blocks from 'buf' into 'file', starting at logical
+//block 'first', allocating as needed and issuing a single vectored
+//request.  Returns the number of blocks written, which is less than
+//'count' if the disk fills up (fserror is set).
+static uint32_t write_block_run(File file, char *buf, uint32_t first, uint32_t count)
+{
+    void *bufs[MAX_VECTOR_BLOCKS];
+    unsigned long blocknums[MAX_VECTOR_BLOCKS];
+    uint32_t n = 0;
+
+    count = allocate_blocks(file, first, count);
+    if(count == 0)
+    {
+        return 0;
+    }
+    for(; n < count; n++)
+    {
+        bufs[n] = buf + (uint64_t)n * SOFTWARE_DISK_BLOCK_SIZE;
+        blocknums[n] = file_block(file, first + n);
+    }
+    if(n > 0 && !writev_cached_blocks(bufs, blocknums, n))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return n;
+}
+
+//set up the read-ahead state of a newly opened 'file'
+static void init_read_ahead(File file)
+{
+    file->ra_window = DEFAULT_READ_AHEAD_BLOCKS;
+    file->ra_buf = NULL;
+    file->ra_start = 0;
+    file->ra_count = 0;
+    file->ra_next = 0;
+    bzero(&file->ra_stats, sizeof(file->ra_stats));
+    file->ra_ahead_buf = NULL;
+    file->ra_reqs = NULL;
+    file->ra_nreqs = 0;
+    file->ra_ahead_count = 0;
+}
+
+//wait for the prefetch of the next window of 'file'.  Returns 1 if every
+//request succeeded.
+static int finish_prefetch(File file)
+{
+    int ok = 1;
+    for(uint32_t i = 0; i < file->ra_nreqs; i++)
+    {
+        ok &= wait_sd_request(&file->ra_reqs[i]);
+    }
+    file->ra_nreqs = 0;
+    return ok;
+}
+
+//forget the next window of 'file', which is about to go stale
+static void drop_prefetch(File file)
+{
+    finish_prefetch(file);
+    file->ra_ahead_count = 0;
+}
+
+//queue reads for the window after the current one, so the disk works on
+//it while the caller consumes this one
+static void start_prefetch(File file)
+{
+    uint32_t first = file->ra_start + file->ra_count;
+    uint32_t last = (file->inode.file_size + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    if(first >= last)
+    {
+        return;
+    }
+    uint32_t count = last - first < file->ra_window ? last - first : file->ra_window;
+    if(file->ra_ahead_buf == NULL)
+    {
+        file->ra_ahead_buf = malloc((size_t)file->ra_window * SOFTWARE_DISK_BLOCK_SIZE);
+        file->ra_reqs = malloc(file->ra_window * sizeof(SDRequest));
+        if(file->ra_ahead_buf == NULL || file->ra_reqs == NULL)
+        {
+            //prefetching is only an optimization
+            free(file->ra_ahead_buf);
+            free(file->ra_reqs);
+            file->ra_ahead_buf = NULL;
+            file->ra_reqs = NULL;
+            return;
+        }
+    }
+
+    //one request per run of consecutive data blocks
+    for(uint32_t i = 0; i < count; )
+    {
+        char *dest = file->ra_ahead_buf + (uint64_t)i * SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t block = file_block(file, first + i);
+        if(block == 0)
+        {
+            bzero(dest, SOFTWARE_DISK_BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        uint32_t n = 1;
+        while(i + n < count && file_block(file, first + i + n) == block + n)
+        {
+            n++;
+        }
+        SDRequest *req = &file->ra_reqs[file->ra_nreqs];
+        bzero(req, sizeof(*req));
+        req->buf = dest;
+        req->blocknum = block;
+        req->count = n;
+        if(!submit_sd_request(req))
+        {
+            drop_prefetch(file);
+            return;
+        }
+        file->ra_nreqs++;
+        i += n;
+    }
+    file->ra_ahead_start = first;
+    file->ra_ahead_count = count;
+}
+
+//fill the read-ahead buffer of 'file' with the window starting at logical
+//block 'first', which the caller needs right now, and start prefetching
+//the window after it.  Returns 1 on success.
+static int fill_read_ahead(File file, uint32_t first)
+{
+    //the prefetched window is the one wanted, so swap it in
+    if(file->ra_ahead_count > 0 && file->ra_ahead_start == first && finish_prefetch(file))
+    {
+        char *buf = file->ra_buf;
+        file->ra_buf = file->ra_ahead_buf;
+        file->ra_ahead_buf = buf;
+        file->ra_start = first;
+        file->ra_count = file->ra_ahead_count;
+        file->ra_ahead_count = 0;
+        file->ra_last = first;
+        file->ra_stats.prefetched += file->ra_count;
+        file->ra_stats.hits++;
+        start_prefetch(file);
+        return 1;
+    }
+    drop_prefetch(file);
+
+    if(file->ra_buf == NULL)
+    {
+        file->ra_buf = malloc((size_t)file->ra_window * SOFTWARE_DISK_BLOCK_SIZE);
+        if(file->ra_buf == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+
+    //stop at the end of file
+    uint32_t last = (file->inode.file_size + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    uint32_t count = last - first < file->ra_window ? last - first : file->ra_window;
+    file->ra_count = 0;
+    if(!read_block_run(file, &file->cursor, file->ra_buf, first, count))
+    {
+        return 0;
+    }
+    file->ra_start = first;
+    file->ra_count = count;
+    file->ra_last = first;
+    file->ra_stats.prefetched += count - 1;
+    start_prefetch(file);
+    return 1;
+}
+
+//release the read-ahead buffers of 'file'
+static void free_read_ahead(File file)
+{
+    drop_prefetch(file);
+    free(file->ra_buf);
+    free(file->ra_ahead_buf);
+    free(file->ra_reqs);
+    file->ra_buf = NULL;
+    file->ra_ahead_buf = NULL;
+    file->ra_reqs = NULL;
+    file->ra_count = 0;
+}
+
+//write every buffered block of 'file' out, allocating blocks for them
+//first, with a single vectored request.  Blocks that couldn't be
+//written, for lack of space or an I/O error, stay buffered (fserror is
+//set).  Returns 1 if the buffer was emptied.
+static int flush_write_buffer(File file)
+{
+    if(file->wb_count == 0)
+    {
+        return 1;
+    }
+
+    //allocation is delayed until now, so consecutive buffered blocks can
+    //be given one contiguous run
+    uint32_t order[WRITE_BUFFER_BLOCKS];
+    for(uint32_t i = 0; i < file->wb_count; i++)
+    {
+        uint32_t j = i;
+        for(; j > 0 && file->wb_blocks[order[j - 1]] > file->wb_blocks[i]; j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    void *bufs[WRITE_BUFFER_BLOCKS];
+    unsigned long blocknums[WRITE_BUFFER_BLOCKS];
+    uint32_t n = 0;
+    while(n < file->wb_count)
+    {
+        uint32_t first = file->wb_blocks[order[n]];
+        uint32_t run = 1;
+        while(n + run < file->wb_count && file->wb_blocks[order[n + run]] == first + run)
+        {
+            run++;
+        }
+        uint32_t got = allocate_blocks(file, first, run);
+        for(uint32_t i = 0; i < got; i++, n++)
+        {
+            bufs[n] = file->wb_buf + (uint64_t)order[n] * SOFTWARE_DISK_BLOCK_SIZE;
+            blocknums[n] = file_block(file, first + i);
+        }
+        if(got < run)
+        {
+            break;
+        }
+    }
+    int ok = n == file->wb_count;
+    if(n > 0 && !writev_cached_blocks(bufs, blocknums, n))
+    {
+        fserror = FS_IO_ERROR;
+        ok = 0;
+        n = 0;
+    }
+
+    //only the blocks written leave the buffer; the rest stay for the
+    //error to be reported and a later flush to retry
+    char written[WRITE_BUFFER_BLOCKS] = { 0 };
+    for(uint32_t i = 0; i < n; i++)
+    {
+        written[order[i]] = 1;
+    }
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < file->wb_count; i++)
+    {
+        if(written[i])
+        {
+            continue;
+        }
+        if(kept != i)
+        {
+            file->wb_blocks[kept] = file->wb_blocks[i];
+            memcpy(file->wb_buf + (uint64_t)kept * SOFTWARE_DISK_BLOCK_SIZE,
+                   file->wb_buf + (uint64_t)i * SOFTWARE_DISK_BLOCK_SIZE,
+                   SOFTWARE_DISK_BLOCK_SIZE);
+        }
+        kept++;
+    }
+    file->wb_count = kept;
+    if(file->extents_dirty && !store_extents(file))
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+//return the write buffer slot holding logical block 'n' of 'file',
+//claiming one if necessary.  A newly claimed slot starts out with the
+//block's current contents, so a block is only read once however many
+//partial writes land in it.  Returns NULL on failure (fserror is set).
+static char *write_buffer_slot(File file, uint32_t n)
+{
+    for(uint32_t i = 0; i < file->wb_count; i++)
+    {
+        if(file->wb_blocks[i] == n)
+        {
+            return file->wb_buf + (uint64_t)i * SOFTWARE_DISK_BLOCK_SIZE;
+        }
+    }
+
+    if(file->wb_buf == NULL)
+    {
+        file->wb_buf = malloc((size_t)WRITE_BUFFER_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE);
+        if(file->wb_buf == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return NULL;
+        }
+    }
+    else if(file->wb_count == WRITE_BUFFER_BLOCKS && !flush_write_buffer(file))
+    {
+        return NULL;
+    }
+
+    char *slot = file->wb_buf + (uint64_t)file->wb_count * SOFTWARE_DISK_BLOCK_SIZE;
+    uint32_t block = file_block(file, n);
+    if(block == 0)
+    {
+        bzero(slot, SOFTWARE_DISK_BLOCK_SIZE);
+    }
+    else if(!read_cached_block(slot, block))
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    file->wb_blocks[file->wb_count++] = n;
+    return slot;
+}
+
+//forget buffered copies of logical blocks 'first' .. 'first'+'count'-1,
+//which are about to be overwritten in full
+static void discard_write_buffer(File file, uint32_t first, uint32_t count)
+{
+    for(uint32_t i = 0; i < file->wb_count; )
+    {
+        if(file->wb_blocks[i] >= first && file->wb_blocks[i] - first < count)
+        {
+            file->wb_count--;
+            file->wb_blocks[i] = file->wb_blocks[file->wb_count];
+            memcpy(file->wb_buf + (uint64_t)i * SOFTWARE_DISK_BLOCK_SIZE,
+                   file->wb_buf + (uint64_t)file->wb_count * SOFTWARE_DISK_BLOCK_SIZE,
+                   SOFTWARE_DISK_BLOCK_SIZE);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+//remove 'file' from the open file list
+static void unlink_open_file(File file)
+{
+    File *p = &fs->open_list;
+    while(*p != NULL && *p != file)
+    {
+        p = &(*p)->next_open;
+    }
+    if(*p != NULL)
+    {
+        *p = file->next_open;
+    }
+}
+
+//make the calling thread work on filesystem 'to', with its software disk
+//and block cache, and return the filesystem it worked on until now
+static FSState *enter_fs(FSState *to)
+{
+    FSState *from = fs;
+    if(to != from)
+    {
+        fs = to;
+        use_software_disk(to->disk);
+        use_block_cache(to->cache);
+    }
+    return from;
+}
+
+//lock of the inode behind open 'file'
+static FSRWLock *file_lock(File file)
+{
+    return &fs->inode_locks[file->dir.inode_index];
+}
+
+//copy the inode and inline data of 'file' into the in-memory inode table
+//and directory, if they have changed.  They go together so a commit
+//never pairs a new file size with old data.  The caller holds dir_lock
+//and, unless 'file' is being closed, its inode lock.
+static void write_inline(File file)
+{
+    if(file->inline_dirty)
+    {
+        write_inode(file->dir.inode_index, &file->inode);
+        write_dir_entry(file->dir_index, &file->dir);
+        file->inline_dirty = 0;
+    }
+}
+
+//write out the buffers of every open file and all dirty metadata.  The
+//caller holds dir_lock, which keeps the open file list still.
+static int write_back_all(void)
+{
+    int ok = 1;
+    for(File file = fs->open_list; file != NULL; file = file->next_open)
+    {
+        fs_wrlock(file_lock(file));
+        ok &= flush_write_buffer(file);
+        write_inline(file);
+        fs_rwunlock(file_lock(file));
+    }
+    if(!write_back_metadata())
+    {
+        fserror = FS_IO_ERROR;
+        ok = 0;
+    }
+    return ok;
+}
+
+//keep what a program that never unmounts has done, on every filesystem
+static void unmount_at_exit(void)
+{
+    FSState *saved = fs;
+    fs_lock(&instances_lock);
+    for(FSState *f = instances; f != NULL; f = f->next)
+    {
+        enter_fs(f);
+        fs_lock(&fs->mount_lock);
+        if(fs->mounted)
+        {
+            fs_lock(&fs->dir_lock);
+            write_back_all();
+            fs_unlock(&fs->dir_lock);
+            flush_block_cache();
+        }
+        fs_unlock(&fs->mount_lock);
+    }
+    fs_unlock(&instances_lock);
+    enter_fs(saved);
+}
+
+//lay out a disk of 'num_blocks' blocks holding 'max_files' files in 'g'.
+//Returns 0 if that leaves no room for data blocks.
+static int plan_geometry(Geometry *g, uint64_t num_blocks, uint64_t max_files)
+{
+    if(max_files == 0 || max_files > INT32_MAX || num_blocks > UINT32_MAX)
+    {
+        return 0;
+    }
+    bzero(g, sizeof(*g));
+    g->num_blocks = num_blocks;
+    g->max_files = max_files;
+    g->num_inode_blocks = (max_files + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    g->num_dir_blocks = (max_files + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    uint64_t inode_bitmap_blocks = (max_files + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t fixed = 1 + inode_bitmap_blocks + g->num_inode_blocks + g->num_dir_blocks;
+
+    //the data bitmap and the journal both grow with the metadata, so size
+    //the data bitmap until it covers what is left
+    uint64_t data_bitmap_blocks = 1, metadata, capacity, data;
+    for(;;)
+    {
+        metadata = fixed + data_bitmap_blocks;
+        capacity = metadata < MAX_JOURNAL_BLOCKS ? metadata : MAX_JOURNAL_BLOCKS;
+        if(num_blocks <= metadata + 1 + capacity)
+        {
+            return 0;
+        }
+        data = num_blocks - metadata - 1 - capacity;
+        uint64_t need = (data + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        if(need <= data_bitmap_blocks)
+        {
+            break;
+        }
+        data_bitmap_blocks = need;
+    }
+
+    g->inode_bitmap = SUPERBLOCK_BLOCK + 1;
+    g->data_bitmap = g->inode_bitmap + inode_bitmap_blocks;
+    g->num_data_bitmap_blocks = data_bitmap_blocks;
+    g->first_inode_block = g->data_bitmap + data_bitmap_blocks;
+    g->first_dir_block = g->first_inode_block + g->num_inode_blocks;
+    g->num_metadata_blocks = metadata;
+    g->first_journal_block = metadata;
+    g->journal_capacity = capacity;
+    g->first_data_block = metadata + 1 + capacity;
+    g->num_data_blocks = data;
+    for(g->hash_buckets = 1; g->hash_buckets < max_files; g->hash_buckets *= 2)
+    {
+    }
+    return 1;
+}
+
+//release the in-memory metadata of the mounted filesystem
+static void free_metadata(void)
+{
+    if(fs->inode_locks)
+    {
+        for(uint32_t i = 0; i < fs->geo.max_files; i++)
+        {
+            fs_rwlock_destroy(&fs->inode_locks[i]);
+        }
+    }
+    free(fs->inode_locks);
+    free(fs->inode_blocks);
+    free(fs->dir_entries);
+    free(fs->dirty);
+    free(fs->inode_alloc.words);
+    free(fs->data_alloc.words);
+    free(fs->dir_index.buckets);
+    free(fs->dir_index.next);
+    fs->inode_locks = NULL;
+    fs->inode_blocks = NULL;
+    fs->dir_entries = NULL;
+    fs->dirty = NULL;
+    fs->inode_alloc.words = NULL;
+    fs->data_alloc.words = NULL;
+    fs->dir_index.buckets = NULL;
+    fs->dir_index.next = NULL;
+}
+
+//allocate the in-memory metadata for layout 'geo'.  Returns 1 on success.
+static int alloc_metadata(void)
+{
+    uint64_t inode_bitmap_blocks = fs->geo.data_bitmap - fs->geo.inode_bitmap;
+    fs->inode_locks = malloc(fs->geo.max_files * sizeof(FSRWLock));
+    fs->inode_blocks = malloc((size_t)fs->geo.num_inode_blocks * SOFTWARE_DISK_BLOCK_SIZE);
+    fs->dir_entries = malloc((size_t)fs->geo.num_dir_blocks * SOFTWARE_DISK_BLOCK_SIZE);
+    fs->dirty = calloc(fs->geo.num_metadata_blocks, 1);
+    fs->inode_alloc.words = malloc(inode_bitmap_blocks * SOFTWARE_DISK_BLOCK_SIZE);
+    fs->data_alloc.words = malloc((size_t)fs->geo.num_data_bitmap_blocks * SOFTWARE_DISK_BLOCK_SIZE);
+    fs->dir_index.buckets = malloc(fs->geo.hash_buckets * sizeof(int32_t));
+    fs->dir_index.next = malloc(fs->geo.max_files * sizeof(int32_t));
+    if(!fs->inode_locks || !fs->inode_blocks || !fs->dir_entries || !fs->dirty || !fs->inode_alloc.words
+       || !fs->data_alloc.words || !fs->dir_index.buckets || !fs->dir_index.next)
+    {
+        free(fs->inode_locks);
+        fs->inode_locks = NULL;
+        free_metadata();
+        return 0;
+    }
+    for(uint32_t i = 0; i < fs->geo.max_files; i++)
+    {
+        fs_rwlock_init(&fs->inode_locks[i]);
+    }
+    return 1;
+}
+
+//fill in and write the superblock of a fresh filesystem of 'num_blocks'
+//blocks holding 'max_files' files.  The rest of the disk must be zeroed.
+static int write_superblock(uint64_t num_blocks, uint64_t max_files)
+{
+    Geometry g;
+    if(!plan_geometry(&g, num_blocks, max_files))
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+    bzero(&fs->super, sizeof(fs->super));
+    fs->super.super.magic = FS_MAGIC;
+    fs->super.super.version = FS_VERSION;
+    fs->super.super.block_size = SOFTWARE_DISK_BLOCK_SIZE;
+    fs->super.super.num_blocks = num_blocks;
+    fs->super.super.max_files = max_files;
+    void *buf = &fs->super;
+    unsigned long blocknum = SUPERBLOCK_BLOCK;
+    if(!writev_cached_blocks(&buf, &blocknum, 1) || !sync_software_disk())
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return 1;
+}
+
+//read the superblock and derive 'geo' from it.  A disk that is still all
+//zeros gets a filesystem with the default number of files.
+static int load_superblock(void)
+{
+    static const SuperblockBlock zeros;
+    if(!read_cached_block(&fs->super, SUPERBLOCK_BLOCK))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    if(memcmp(&fs->super, &zeros, sizeof(zeros)) == 0
+       && !write_superblock(software_disk_size(), DEFAULT_MAX_FILES))
+    {
+        return 0;
+    }
+    Superblock *super = &fs->super.super;
+    if(super->magic != FS_MAGIC || super->version != FS_VERSION
+       || super->block_size != SOFTWARE_DISK_BLOCK_SIZE
+       || super->num_blocks > software_disk_size()
+       || !plan_geometry(&fs->geo, super->num_blocks, super->max_files))
+    {
+        fserror = FS_NOT_FORMATTED;
+        return 0;
+    }
+    return 1;
+}
+
+//the body of mount_fs().  The caller holds mount_lock and dir_lock.
+static int load_metadata(void)
+{
+    if(!open_software_disk())
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    if(!load_superblock())
+    {
+        return 0;
+    }
+
+    //finish whatever transaction a crash interrupted
+    if(!replay_journal() || !alloc_metadata())
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    fs->checkpoint_unsynced = 0;
+    fs->group.pending_ops = 0;
+    bzero(&fs->group.stats, sizeof(fs->group.stats));
+
+    //bitmaps, inode table and directory come in with one vectored read
+    //per MAX_VECTOR_BLOCKS blocks
+    void *bufs[MAX_VECTOR_BLOCKS];
+    unsigned long blocknums[MAX_VECTOR_BLOCKS];
+    for(uint32_t first = SUPERBLOCK_BLOCK + 1; first < fs->geo.num_metadata_blocks; first += MAX_VECTOR_BLOCKS)
+    {
+        uint32_t n = 0;
+        for(uint32_t b = first; b < fs->geo.num_metadata_blocks && n < MAX_VECTOR_BLOCKS; b++, n++)
+        {
+            bufs[n] = metadata_block(b);
+            blocknums[n] = b;
+        }
+        if(!readv_cached_blocks(bufs, blocknums, n))
+        {
+            free_metadata();
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    init_bit_allocator(&fs->data_alloc, fs->geo.data_bitmap, fs->geo.num_data_blocks);
+    init_bit_allocator(&fs->inode_alloc, fs->geo.inode_bitmap, fs->geo.max_files);
+
+    //index the directory.  Nothing is open yet, so open flags left behind
+    //by a program that never closed its files are stale.
+    for(uint32_t b = 0; b < fs->geo.hash_buckets; b++)
+    {
+        fs->dir_index.buckets[b] = -1;
+    }
+    for(uint32_t e = 0; e < fs->geo.max_files; e++)
+    {
+        DirectoryEntry *dir = dir_entry(e);
+        if(dir->file_name[0] != '\0')
+        {
+            dir_index_insert(e);
+        }
+        if(dir->open)
+        {
+            dir->open = 0;
+            fs->dirty[fs->geo.first_dir_block + e / DIR_ENTRIES_PER_BLOCK] = 1;
+        }
+    }
+
+    //filesystems on other threads can be mounting too
+    static int registered = 0;
+    static FSLock registered_lock = FS_LOCK_INITIALIZER;
+    fs_lock(&registered_lock);
+    if(!registered)
+    {
+        atexit(unmount_at_exit);
+        registered = 1;
+    }
+    fs_unlock(&registered_lock);
+    fs->open_list = NULL;
+    fs->mounted = 1;
+    return 1;
+}
+
+//the body of open_fs() and open_striped_fs(): make a filesystem handle
+//that owns 'disk' and gets a block cache of its own
+static FSState *new_fs(SoftwareDisk disk)
+{
+    FSState *f = disk ? calloc(1, sizeof(FSState)) : NULL;
+    if(f != NULL)
+    {
+        f->disk = disk;
+        f->cache = new_block_cache(disk);
+    }
+    if(f == NULL || f->cache == NULL)
+    {
+        free_software_disk(disk);
+        free(f);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    fs_lock_init(&f->data_alloc.lock);
+    fs_lock_init(&f->inode_alloc.lock);
+    fs_lock_init(&f->mount_lock);
+    fs_lock_init(&f->dir_lock);
+    fs_lock_init(&f->meta_lock);
+
+    fs_lock(&instances_lock);
+    f->next = instances;
+    instances = f;
+    fs_unlock(&instances_lock);
+    return f;
+}
+
+Filesystem open_fs(const char *path){
+    fserror = FS_NONE;
+    if(path == NULL || path[0] == '\0')
+    {
+        fserror = FS_ILLEGAL_FILENAME;
+        return NULL;
+    }
+    return new_fs(new_software_disk(path));
+}
+
+Filesystem open_striped_fs(const char **paths, unsigned long nfiles, unsigned long stripe_blocks){
+    fserror = FS_NONE;
+    for(unsigned long i = 0; paths != NULL && i < nfiles; i++)
+    {
+        if(paths[i] == NULL || paths[i][0] == '\0')
+        {
+            fserror = FS_ILLEGAL_FILENAME;
+            return NULL;
+        }
+    }
+    return new_fs(new_striped_software_disk(paths, nfiles, stripe_blocks));
+}
+
+int close_fs(Filesystem f){
+    fserror = FS_NONE;
+    if(f == NULL || f == &default_fs)
+    {
+        return 1;
+    }
+    FSState *saved = enter_fs(f);
+    if(!unmount_fs())
+    {
+        enter_fs(saved);
+        return 0;
+    }
+
+    fs_lock(&instances_lock);
+    FSState **p = &instances;
+    while(*p != f)
+    {
+        p = &(*p)->next;
+    }
+    *p = f->next;
+    fs_unlock(&instances_lock);
+
+    //the cache writes back through the disk, so it goes first
+    int ok = free_block_cache(f->cache);
+    free_software_disk(f->disk);
+    enter_fs(saved == f ? &default_fs : saved);
+    fs_lock_destroy(&f->data_alloc.lock);
+    fs_lock_destroy(&f->inode_alloc.lock);
+    fs_lock_destroy(&f->mount_lock);
+    fs_lock_destroy(&f->dir_lock);
+    fs_lock_destroy(&f->meta_lock);
+    free(f);
+    if(!ok)
+    {
+        fserror = FS_IO_ERROR;
+    }
+    return ok;
+}
+
+Filesystem use_fs(Filesystem f){
+    return enter_fs(f != NULL ? f : &default_fs);
+}
+
+int mount_fs(void){
+    fserror = FS_NONE;
+    fs_lock(&fs->mount_lock);
+    fs_lock(&fs->dir_lock);
+    int ok = fs->mounted || load_metadata();
+    fs_unlock(&fs->dir_lock);
+    fs_unlock(&fs->mount_lock);
+    return ok;
+}
+
+int unmount_fs(void){
+    fserror = FS_NONE;
+    int ok = 1;
+    fs_lock(&fs->mount_lock);
+    fs_lock(&fs->dir_lock);
+    if(!fs->mounted)
+    {
+        ok = 1;
+    }
+    else if(fs->open_list != NULL)
+    {
+        fserror = FS_FILE_OPEN;
+        ok = 0;
+    }
+    else if(!write_back_all() || !flush_block_cache() || !sync_software_disk())
+    {
+        fserror = FS_IO_ERROR;
+        ok = 0;
+    }
+    else
+    {
+        fs->mounted = 0;
+        free_metadata();
+        close_software_disk();
+    }
+    fs_unlock(&fs->dir_lock);
+    fs_unlock(&fs->mount_lock);
+    return ok;
+}
+
+//zero metadata blocks 'first' .. 'first'+'count'-1, MAX_VECTOR_BLOCKS to
+//a request.  Returns 1 on success.
+static int zero_metadata(uint32_t first, uint32_t count)
+{
+    void *bufs[MAX_VECTOR_BLOCKS];
+    unsigned long blocknums[MAX_VECTOR_BLOCKS];
+    while(count > 0)
+    {
+        uint32_t n = count < MAX_VECTOR_BLOCKS ? count : MAX_VECTOR_BLOCKS;
+        for(uint32_t i = 0; i < n; i++)
+        {
+            bufs[i] = zero_block;
+            blocknums[i] = first + i;
+        }
+        if(!writev_cached_blocks(bufs, blocknums, n))
+        {
+            return 0;
+        }
+        first += n;
+        count -= n;
+    }
+    return 1;
+}
+
+//the body of format_fs() and quick_format_fs().  The caller holds
+//mount_lock and dir_lock.  A full format recreates the disk with
+//'num_blocks' blocks; a quick one keeps the disk and only zeroes the
+//metadata blocks and the journal header.
+static int format_locked(unsigned long num_blocks, unsigned long max_files, int quick)
+{
+    if(fs->mounted && fs->open_list != NULL)
+    {
+        fserror = FS_FILE_OPEN;
+        return 0;
+    }
+
+    //a format that can't go ahead leaves the mounted filesystem alone
+    Geometry g;
+    if(!plan_geometry(&g, num_blocks, max_files))
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return 0;
+    }
+
+    //whatever was mounted or cached belongs to the old filesystem
+    if(fs->mounted)
+    {
+        fs->mounted = 0;
+        free_metadata();
+    }
+    invalidate_block_cache();
+
+    if(quick ? !zero_metadata(SUPERBLOCK_BLOCK + 1, g.num_metadata_blocks - 1)
+                    || !zero_metadata(g.first_journal_block, 1)
+                  : !init_software_disk_size(num_blocks))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    return write_superblock(num_blocks, max_files);
+}
+
+int format_fs(unsigned long num_blocks, unsigned long max_files){
+    fserror = FS_NONE;
+    fs_lock(&fs->mount_lock);
+    fs_lock(&fs->dir_lock);
+    int ok = format_locked(num_blocks, max_files, 0);
+    fs_unlock(&fs->dir_lock);
+    fs_unlock(&fs->mount_lock);
+    return ok;
+}
+
+int quick_format_fs(unsigned long max_files){
+    fserror = FS_NONE;
+    fs_lock(&fs->mount_lock);
+    fs_lock(&fs->dir_lock);
+    int ok = 1;
+    if(!open_software_disk())
+    {
+        fserror = FS_NOT_FORMATTED;
+        ok = 0;
+    }
+    else
+    {
+        ok = format_locked(software_disk_size(), max_files, 1);
+    }
+    fs_unlock(&fs->dir_lock);
+    fs_unlock(&fs->mount_lock);
+    return ok;
+}
+
+int sync_fs(void){
+    fserror = FS_NONE;
+    fs_lock(&fs->dir_lock);
+    int mounted = fs->mounted;
+    int ok = !mounted || write_back_all();
+    fs_unlock(&fs->dir_lock);
+    if(ok && mounted && (!flush_block_cache() || !sync_software_disk()))
+    {
+        fserror = FS_IO_ERROR;
+        ok = 0;
+    }
+    return ok;
+}
+
+int set_group_commit(unsigned long max_ops, unsigned long max_usecs){
+    fserror = FS_NONE;
+    if(max_ops > UINT32_MAX)
+    {
+        max_ops = UINT32_MAX;
+    }
+    fs_lock(&fs->dir_lock);
+    fs->group.max_ops = max_ops;
+    fs->group.max_usecs = max_usecs;
+    fs_unlock(&fs->dir_lock);
+    return 1;
+}
+
+void get_commit_stats(CommitStats *stats){
+    fserror = FS_NONE;
+    fs_lock(&fs->dir_lock);
+    *stats = fs->group.stats;
+    fs_unlock(&fs->dir_lock);
+}
+
+void reset_commit_stats(void){
+    fserror = FS_NONE;
+    fs_lock(&fs->dir_lock);
+    bzero(&fs->group.stats, sizeof(fs->group.stats));
+    fs_unlock(&fs->dir_lock);
+}
+
+//the body of open_file().  The caller holds dir_lock.
+static File open_dir_entry(char *name, FileMode mode)
+{
+    uint32_t index;
+    DirectoryEntry dir;
+    if(!find_dir_entry(name, &index, &dir))
+    {
+        fserror = FS_FILE_NOT_FOUND;
+        return NULL;
+    }
+    //check if file is open
+    else if(dir.open)
+    {
+        fserror = FS_FILE_OPEN;
+        return NULL;
+    }
+
+    //make the file from its inode and extents
+    File file = malloc(sizeof(FileInternals));
+    if(!file)
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    file->position = 0;
+    file->mode = mode;
+    file->dir_index = index;
+    init_read_ahead(file);
+    file->wb_buf = NULL;
+    file->wb_count = 0;
+    file->inline_dirty = 0;
+    read_inode(dir.inode_index, &file->inode);
+    if(!open_extents(file))
+    {
+        free(file);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+
+    //set file as opened
+    dir.open = 1;
+    file->dir = dir;
+    write_dir_entry(index, &dir);
+    file->fs = fs;
+    file->next_open = fs->open_list;
+    fs->open_list = file;
+    return file;
+}
+
+//the body of create_file().  The caller holds dir_lock.
+static File create_dir_entry(char *name)
+{
+    DirectoryEntry dir;
+    uint32_t index;
+    if(find_dir_entry(name, &index, &dir))
+    {
+        fserror = FS_FILE_ALREADY_EXISTS;
+        return NULL;
+    }
+
+    //find free directory entry
+    index = free_dir_entry();
+    if(index == fs->geo.max_files)
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return NULL;
+    }
+
+    //find free bit and mark it as used in the inode bitmap
+    int64_t inode_index = allocate_from_bitmap(&fs->inode_alloc);
+    if(inode_index < 0)
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return NULL;
+    }
+
+    File file = malloc(sizeof(FileInternals));
+    if(!file)
+    {
+        release_to_bitmap(&fs->inode_alloc, inode_index);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+
+    //create directory entry and mark it as open
+    bzero(&dir, sizeof(dir));
+    dir.open = 1;
+    dir.inode_index = inode_index;
+    strcpy(dir.file_name, name);
+
+    file->position = 0;
+    file->mode = READ_WRITE;
+    file->dir = dir;
+    file->dir_index = index;
+    init_read_ahead(file);
+    file->wb_buf = NULL;
+    file->wb_count = 0;
+    file->inline_dirty = 0;
+    bzero(&file->inode, sizeof(file->inode));
+    if(!open_extents(file))
+    {
+        release_to_bitmap(&fs->inode_alloc, inode_index);
+        free(file);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+
+    //files start out inline and only get data blocks once they outgrow
+    //their directory entry
+    file->inode.flags = INODE_INLINE;
+    write_inode(inode_index, &file->inode);
+    write_dir_entry(index, &dir);
+    file->fs = fs;
+    file->next_open = fs->open_list;
+    fs->open_list = file;
+    return file;
+}
+
+File open_file(char *name, FileMode mode){
+    fserror = FS_NONE;
+    if(!ensure_mounted())
+    {
+        return NULL;
+    }
+    fs_lock(&fs->dir_lock);
+    File file = open_dir_entry(name, mode);
+    if(file != NULL)
+    {
+        note_metadata_op();
+    }
+    fs_unlock(&fs->dir_lock);
+    return file;
+}
+
+File create_file(char *name){
+    fserror = FS_NONE;
+    if(name == NULL || name[0] == '\0' || strlen(name) >= MAX_FILENAME_SIZE)
+    {
+        fserror = FS_ILLEGAL_FILENAME;
+        return NULL;
+    }
+    else if(!ensure_mounted())
+    {
+        return NULL;
+    }
+    fs_lock(&fs->dir_lock);
+    File file = create_dir_entry(name);
+    if(file != NULL)
+    {
+        note_metadata_op();
+    }
+    fs_unlock(&fs->dir_lock);
+    return file;
+}
+
+void close_file(File file){
+    fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return;
+    }
 
-//struct for indirect block
-typedef struct IndirectBlock {
-    uint16_t blocks[NUM_SINGLE_INDIRECT_INODE_BLOCKS];
-} IndirectBlock;
+    //write out buffered blocks; a failure is reported but still closes
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    if(flush_write_buffer(file) && !store_extents(file))
+    {
+        fserror = FS_IO_ERROR;
+    }
+    fs_rwunlock(file_lock(file));
 
-//struct for inode
-typedef struct Inode {
-    uint32_t file_size;                       //file size
-    uint16_t blocks[14];                      //direct blocks + the indirect
-} Inode;
+    //set file to closed in its directory entry
+    fs_lock(&fs->dir_lock);
+    write_inline(file);
+    file->dir.open = 0;
+    write_dir_entry(file->dir_index, &file->dir);
+    unlink_open_file(file);
+    note_metadata_op();
+    fs_unlock(&fs->dir_lock);
+    free_read_ahead(file);
+    free_extents(file);
+    free(file->wb_buf);
+    free(file);
+    enter_fs(saved);
+}
 
-//struct for a block on inodes
-typedef struct InodeBlock {
-    Inode inodes[128];                       //each inode block holds 128 inodes
-} InodeBlock;
+//copy up to 'numbytes' bytes at byte 'pos' of 'file' into 'buf' and
+//return how many were copied.  With 'cursor' NULL this is read_file(),
+//which may use the read-ahead window and needs the inode lock held for
+//writing.  Otherwise lookups use 'cursor' and nothing in 'file' changes,
+//so readers holding the lock for reading can run side by side; the
+//write buffer must be empty.
+static unsigned long read_at(File file, void *buf, unsigned long numbytes, uint64_t pos,
+                             ExtentCursor *cursor)
+{
+    //never read past the end of file
+    uint64_t size = file->inode.file_size;
+    if(pos >= size)
+    {
+        return 0;
+    }
+    if(numbytes > size - pos)
+    {
+        numbytes = size - pos;
+    }
 
-//struct for directory entries
-typedef struct DirectoryEntry {
-    uint16_t open;                           //is the file open?
-    uint16_t inode_index;                    //inode index
-    char file_name[MAX_FILENAME_SIZE];       //NULL term ASCII filename
-                                             //free if first character of filename is null
-} DirectoryEntry;
+    //inline data is already in memory
+    if(file->inode.flags & INODE_INLINE)
+    {
+        memcpy(buf, inline_data(file) + pos, numbytes);
+        return numbytes;
+    }
 
-//typedef for a single block bitmap, structure must be size of one block
-typedef struct Bitmap {
-    uint8_t bytes[4096];
-} Bitmap;
+    //a read that picks up where the last one stopped is part of a
+    //sequential stream and is served through the read-ahead window
+    int sequential = cursor == NULL && file->ra_window > 0 && pos == file->ra_next;
+    if(cursor == NULL)
+    {
+        cursor = &file->cursor;
+    }
 
-//struct for main file tyoe
-typedef struct FileInternals {
-    uint64_t position;                      //current file position
-    FileMode mode;                          //access mode
-    Inode inode;                            //inode
-    DirectoryEntry dir;                     //directory entry
-    uint16_t dir_block;                     //block # for directory entry
-} FileInternals;
+    unsigned long done = 0;
+    while(done < numbytes)
+    {
+        uint32_t blocknumber = pos / SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t offset = pos % SOFTWARE_DISK_BLOCK_SIZE;
+        unsigned long x = SOFTWARE_DISK_BLOCK_SIZE - offset;
 
+        //requests smaller than the window come out of the read-ahead buffer
+        if(sequential && numbytes - done < (uint64_t)file->ra_window * SOFTWARE_DISK_BLOCK_SIZE)
+        {
+            if(blocknumber >= file->ra_start && blocknumber < file->ra_start + file->ra_count)
+            {
+                if(blocknumber != file->ra_last)
+                {
+                    file->ra_stats.hits++;
+                    file->ra_last = blocknumber;
+                }
+            }
+            else if(!fill_read_ahead(file, blocknumber))
+            {
+                break;
+            }
+            if(x > numbytes - done)
+            {
+                x = numbytes - done;
+            }
+            char *src = file->ra_buf + (uint64_t)(blocknumber - file->ra_start) * SOFTWARE_DISK_BLOCK_SIZE;
+            memcpy((char *)buf + done, src + offset, x);
+            done += x;
+            pos += x;
+            continue;
+        }
 
-uint64_t allocate_bit(uint8_t *data) {
-    int64_t index = -1;
-    for (int64_t i = 0; i < 4096; i++)
-    {
-        for (int64_t j = 0; j <= 7; j++)
+        //whole blocks go out in one vectored request
+        if(offset == 0 && numbytes - done >= SOFTWARE_DISK_BLOCK_SIZE)
         {
-            if((data[i] && (1 << (7-j))) == 0)
+            uint32_t count = (numbytes - done) / SOFTWARE_DISK_BLOCK_SIZE;
+            if(count > MAX_VECTOR_BLOCKS)
+            {
+                count = MAX_VECTOR_BLOCKS;
+            }
+            if(!read_block_run(file, cursor, (char *)buf + done, blocknumber, count))
             {
-                index = i*8*j;
-                return index;
+                break;
             }
+            x = (unsigned long)count * SOFTWARE_DISK_BLOCK_SIZE;
+            done += x;
+            pos += x;
+            continue;
+        }
+        if(x > numbytes - done)
+        {
+            x = numbytes - done;
+        }
+
+        //a hole reads as zeros straight from the zero block; otherwise
+        //the bytes are copied out of the cached block in place
+        char spare[SOFTWARE_DISK_BLOCK_SIZE];
+        char *src = zero_block;
+        uint32_t block = map_block(file, cursor, blocknumber);
+        if(block != 0 && (src = get_block(block, spare)) == NULL)
+        {
+            break;
+        }
+        //copy into buffer
+        memcpy((char *)buf + done, src + offset, x);
+        if(block != 0)
+        {
+            put_block(src, spare);
         }
+        done += x;
+        pos += x;
     }
-    return index;
+    if(cursor == &file->cursor)
+    {
+        file->ra_next = pos;
+    }
+    return done;
 }
 
-void used_bit(uint8_t *data, int64_t index) {
-    for (int64_t i = 0; i < 4096; i++)
+//write 'numbytes' bytes from 'buf' at byte 'pos' of 'file' and return how
+//many were written.  The caller holds the inode lock for writing.
+static unsigned long write_at(File file, void *buf, unsigned long numbytes, uint64_t pos)
+{
+    if(pos + numbytes > MAX_FILE_SIZE)
+    {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        return 0;
+    }
+
+    //a write that still fits inline only touches memory.  Bytes past the
+    //end of an inline file are always zero, so gaps read back as zeros.
+    if(file->inode.flags & INODE_INLINE)
     {
-        for (int64_t j = 0; j <= 7; j++)
+        if(pos + numbytes <= inline_capacity(file))
         {
-            if (i*8+j == index)
+            memcpy(inline_data(file) + pos, buf, numbytes);
+            if(pos + numbytes > file->inode.file_size)
             {
-                data[i] |= 1UL << j; //set bit in bitmap
+                file->inode.file_size = pos + numbytes;
             }
+            file->inline_dirty = 1;
+            return numbytes;
+        }
+        else if(!spill_inline(file))
+        {
+            return 0;
         }
     }
-}
 
-void free_bit(uint8_t *data, int64_t index) {
-    for (int64_t i = 0; i < 4096; i++)
+    //read-ahead blocks may be about to go stale
+    file->ra_count = 0;
+    drop_prefetch(file);
+
+    unsigned long done = 0;
+    while(done < numbytes)
     {
-        for (int64_t j = 0; j <= 7; j++)
+        uint32_t blocknumber = pos / SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t offset = pos % SOFTWARE_DISK_BLOCK_SIZE;
+        unsigned long x = SOFTWARE_DISK_BLOCK_SIZE - offset;
+
+        //whole blocks go out in one vectored request
+        if(offset == 0 && numbytes - done >= SOFTWARE_DISK_BLOCK_SIZE)
         {
-            if (i*8+j == index)
+            uint32_t count = (numbytes - done) / SOFTWARE_DISK_BLOCK_SIZE;
+            if(count > MAX_VECTOR_BLOCKS)
             {
-                data[i] &= ~(1UL << j); //clear bit in bitmap
+                count = MAX_VECTOR_BLOCKS;
             }
+            discard_write_buffer(file, blocknumber, count);
+            uint32_t written = write_block_run(file, (char *)buf + done, blocknumber, count);
+            x = (unsigned long)written * SOFTWARE_DISK_BLOCK_SIZE;
+            done += x;
+            pos += x;
+            if(pos > file->inode.file_size)
+            {
+                file->inode.file_size = pos;
+            }
+            if(written < count)
+            {
+                break;
+            }
+            continue;
+        }
+        if(x > numbytes - done)
+        {
+            x = numbytes - done;
+        }
+
+        //partial blocks collect in the write buffer, so a run of small
+        //writes costs one read and one write per block, not one each
+        char *slot = write_buffer_slot(file, blocknumber);
+        if(slot == NULL)
+        {
+            break;
+        }
+        memcpy(slot + offset, (char *)buf + done, x);
+        done += x;
+        pos += x;
+        if(pos > file->inode.file_size)
+        {
+            file->inode.file_size = pos;
+        }
+    }
+
+    if(file->extents_dirty)
+    {
+        FSError err = fserror;
+        if(store_extents(file) && err != FS_NONE)
+        {
+            fserror = err;
         }
     }
+    else if(done > 0)
+    {
+        write_inode(file->dir.inode_index, &file->inode);
+    }
+    return done;
 }
 
-File open_file(char *name, FileMode mode){
-    File file;
+unsigned long read_file(File file, void *buf, unsigned long numbytes){
     fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    unsigned long done = 0;
+    //buffered writes must reach the disk before they can be read back
+    if(flush_write_buffer(file))
+    {
+        done = read_at(file, buf, numbytes, file->position, NULL);
+        file->position += done;
+    }
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return done;
+}
 
-    if(!file_exists(name))
+unsigned long write_file(File file, void *buf, unsigned long numbytes){
+    fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
     {
-        fserror = FS_FILE_NOT_FOUND;
-        return NULL;
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    else
+    else if (file->mode == READ_ONLY)
     {
-        //iterate through directory entry blocks for the file
-        for(uint16_t i = 6; i < 69; i++)
-        {
-            //read the block
-            char buf[4096];
-            bzero(buf, 4096);
-            read_sd_block(buf, i);
+        fserror = FS_FILE_READ_ONLY;
+        return 0;
+    }
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    unsigned long done = write_at(file, buf, numbytes, file->position);
+    file->position += done;
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return done;
+}
 
-            //create directory entry to copy data into
-            DirectoryEntry dir;
-            memcpy(&dir, &buf, sizeof(dir));
-            //does the filename match?
-            if(strcmp(dir.file_name, name))
-            {
-                //check if file is open
-                if(dir.open)
-                {
-                    fserror = FS_FILE_OPEN;
-                }
-                else
-                {
-                    //get inode block
-                    char buf1[4096];
-                    bzero(buf1, 4096);
-                    read_sd_block(buf1, 2 + dir.inode_index / 4);
-
-                    Inode node;
-                    memcpy(&node, &buf1[dir.inode_index % 4], sizeof(node));
-                    //make the file
-                    file->position = 0;
-                    file->mode = mode;
-                    file->inode = node;
-                    file->dir = dir;
-                    file->dir_block = i;
-
-                    //set file as opened in the software disk
-                    dir.open = 1;
-                    memcpy(&buf, &dir, 4096);
-                    write_sd_block(buf, i);
-                    fserror = FS_NONE;
-                    return file;
-                }
-            }
-            else
-            {
-                fserror = FS_FILE_NOT_FOUND;
-                return NULL;
-            }    
+unsigned long pread_file(File file, void *buf, unsigned long numbytes, unsigned long offset){
+    fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+
+    //buffered writes must reach the disk first, which needs the lock to
+    //ourselves; then readers only share it
+    FSState *saved = enter_fs(file->fs);
+    fs_rdlock(file_lock(file));
+    while(file->wb_count > 0)
+    {
+        fs_rwunlock(file_lock(file));
+        fs_wrlock(file_lock(file));
+        int ok = flush_write_buffer(file);
+        fs_rwunlock(file_lock(file));
+        if(!ok)
+        {
+            enter_fs(saved);
+            return 0;
         }
-        return file;
+        fs_rdlock(file_lock(file));
     }
+    ExtentCursor cursor = { 0, 0 };
+    unsigned long done = read_at(file, buf, numbytes, offset, &cursor);
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return done;
 }
 
-File create_file(char *name){
-    File file;
+unsigned long pwrite_file(File file, void *buf, unsigned long numbytes, unsigned long offset){
     fserror = FS_NONE;
-    if(strcmp(name, "\0"))
+    if(file == NULL || file->dir.open == 0)
     {
-        fserror = FS_ILLEGAL_FILENAME;
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    else if(file_exists(name))
+    else if (file->mode == READ_ONLY)
     {
-        fserror = FS_FILE_ALREADY_EXISTS;
+        fserror = FS_FILE_READ_ONLY;
+        return 0;
     }
-    else
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    unsigned long done = write_at(file, buf, numbytes, offset);
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return done;
+}
+
+//zero bytes 'from' .. 'to'-1 of 'file', which lie in one block, unless
+//that block is a hole.  Returns 1 on success.
+static int zero_part(File file, uint64_t from, uint64_t to)
+{
+    if(from == to)
+    {
+        return 1;
+    }
+    uint32_t n = from / SOFTWARE_DISK_BLOCK_SIZE;
+    int mapped = file_block(file, n) != 0;
+    for(uint32_t i = 0; i < file->wb_count && !mapped; i++)
     {
-        char buf[4096];
-        bzero(buf, 4096);
-        read_sd_block(buf, INODE_BITMAP_BLOCK);
-        //find free bit 
-        uint16_t inode_index = allocate_bit((unsigned char*) buf);
-        //mark bit as used
-        used_bit((unsigned char*) buf, inode_index);
-        //update bitmap
-        write_sd_block(buf, INODE_BITMAP_BLOCK);
-        
-        //create inode for file
-        Inode node;
-        node.file_size = 0;
-        for(int i = 0; i < 14; i++)
-        {
-
-            bzero(buf, 4096);
-            read_sd_block(buf, DATA_BITMAP_BLOCK);
-            //set data_index to the free bit to allocate
-            uint16_t data_index = allocate_bit((unsigned char*) buf);
-            //mark bit at data_index as used
-            used_bit((unsigned char*) buf, data_index);
-            write_sd_block(buf, INODE_BITMAP_BLOCK);
-            //add it to inode blocks
-            node.blocks[i] = data_index;
-        }
-
-        //read and write destination for inode block
-        bzero(buf, 4096);
-        read_sd_block(buf, 2 + (inode_index / 128));
-        unsigned long i = (inode_index % 128) * 4;
-        memcpy(&buf[i], &node, 4);
-        write_sd_block(buf, 2 + (inode_index / 128));
-
-        //create directory entry and mark it as open
-        DirectoryEntry dir;
-        dir.open = 1;
-        dir.inode_index = inode_index;
-        strcpy(dir.file_name, name);
-
-        //find block for direntry
-        for (uint64_t c = 6; c < 69; c++)
-        {
-            //read block
-            char buf[4096];
-            bzero(buf, 4096);
-            read_sd_block(buf, c);
-
-            //make direntry for data
-            DirectoryEntry dir;
-            memcpy(&dir, &buf, sizeof(dir));
-            if(strcmp(dir.file_name, "\0"))
+        mapped = file->wb_blocks[i] == n;
+    }
+    return !mapped || write_at(file, zero_block, to - from, from) == to - from;
+}
+
+//the body of punch_hole() for a range inside the file.  The caller
+//holds the inode lock for writing.
+static int punch_at(File file, uint64_t pos, uint64_t end)
+{
+    if(file->inode.flags & INODE_INLINE)
+    {
+        bzero(inline_data(file) + pos, end - pos);
+        file->inline_dirty = 1;
+        return 1;
+    }
+
+    file->ra_count = 0;
+    drop_prefetch(file);
+
+    //blocks only partly in the range are zeroed, unless they are holes
+    uint64_t first = (pos + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    uint64_t last = end / SOFTWARE_DISK_BLOCK_SIZE;
+    if(first > last)
+    {
+        return zero_part(file, pos, end);
+    }
+    if(!zero_part(file, pos, first * SOFTWARE_DISK_BLOCK_SIZE)
+       || !zero_part(file, last * SOFTWARE_DISK_BLOCK_SIZE, end))
+    {
+        return 0;
+    }
+
+    //whole blocks go back to the bitmap, an extent piece at a time
+    discard_write_buffer(file, first, last - first);
+    uint32_t n = first;
+    while(n < last && n < file->nblocks)
+    {
+        uint32_t block = file_block(file, n);
+        uint32_t left = file->cursor.start + file->extents[file->cursor.extent].length - n;
+        uint32_t count = last - n < left ? last - n : left;
+        if(block != 0)
+        {
+            if(!remap_blocks(file, n, count, 0))
             {
-                fserror = FS_ILLEGAL_FILENAME;
-                break;
+                return 0;
             }
+            free_data_run(block, count);
         }
-        bzero(buf, 4096);
-        memcpy(&buf, &dir, 4096);
-        write_sd_block(buf, i);
-
-        file->position = 0;
-        file->mode = READ_WRITE;
-        file->inode = node;
-        file->dir = dir;
-        file->dir_block = i;
+        n += count;
+    }
 
-        fserror = FS_NONE;
-        return file;
+    //a hole at the end of the map is implied by the file size
+    uint32_t num = file->inode.num_extents;
+    if(num > 0 && file->extents[num - 1].start == 0)
+    {
+        file->nblocks -= file->extents[num - 1].length;
+        file->inode.num_extents = --num;
+        file->cursor.extent = 0;
+        file->cursor.start = 0;
+        file->extents_dirty = 1;
+        if(num < file->dirty_extent)
+        {
+            file->dirty_extent = num;
+        }
     }
-    return file;
+    return !file->extents_dirty || store_extents(file);
 }
 
-void close_file(File file){
+int punch_hole(File file, unsigned long offset, unsigned long numbytes){
     fserror = FS_NONE;
-    if(file->dir.open == 0) 
+    if(file == NULL || file->dir.open == 0)
     {
         fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    else
+    else if (file->mode == READ_ONLY)
     {
-        Inode inode = file->inode;
-        DirectoryEntry dir = file->dir;
-        uint16_t d_block = file->dir_block;
-
-        //set file to closed
-        dir.open = 0;
-
-        //write closed entry into buffer
-        char buf1[4096];
-        bzero(buf1, 4096);
-        memcpy(&buf1, &dir, 4096);
-        write_sd_block(buf1, d_block);
-        fserror = FS_NONE;
+        fserror = FS_FILE_READ_ONLY;
+        return 0;
     }
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    //the range never reaches past the end of file
+    uint64_t size = file->inode.file_size;
+    uint64_t end = numbytes < size - offset ? offset + numbytes : size;
+    int ok = offset >= size || punch_at(file, offset, end);
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return ok;
 }
 
-unsigned long read_file(File file, void *buf, unsigned long numbytes){
-    uint32_t position = file->position;
-    FileMode mode = file->mode;
-    Inode inode = file->inode;
-    DirectoryEntry dir = file->dir;
-    uint16_t d_block = file->dir_block;
+int fsync_file(File file){
     fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    int ok = flush_write_buffer(file) && store_extents(file);
+    fs_rwunlock(file_lock(file));
+    ok = ok && sync_fs();
+    enter_fs(saved);
+    return ok;
+}
 
-    if(dir.open)
+int seek_file(File file, unsigned long bytepos){
+    fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
     {
         fserror = FS_FILE_NOT_OPEN;
         return 0;
     }
-    else if(position > file_length(file))
+
+    FSState *saved = enter_fs(file->fs);
+    if(bytepos > MAX_FILE_SIZE)
     {
-        fserror = FS_IO_ERROR;
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        enter_fs(saved);
         return 0;
     }
-        else
+    fs_wrlock(file_lock(file));
+    //seeking past the end of file extends it
+    int ok = 1;
+    if(bytepos > file->inode.file_size)
+    {
+        if((file->inode.flags & INODE_INLINE) && bytepos > inline_capacity(file))
+        {
+            ok = spill_inline(file);
+        }
+        if(ok)
         {
-            uint32_t blocknumber = 0;
-            while(numbytes > 0)
+            file->inode.file_size = bytepos;
+            if(file->inode.flags & INODE_INLINE)
             {
-                char buf1[4096];
-                bzero(buf1, 4096);
-                //read iblock
-                read_sd_block(buf1, inode.blocks[blocknumber]);
-                //copy into buffer
-                //potential issues with sizing here
-                unsigned long x = sizeof(&buf1);
-                memcpy(&buf, &buf1, x);
-                numbytes -= x;
-                blocknumber += 1;
+                file->inline_dirty = 1;
+            }
+            else
+            {
+                write_inode(file->dir.inode_index, &file->inode);
             }
-            fserror = FS_NONE;
-            return numbytes;
         }
-    return numbytes;
+    }
+    if(ok)
+    {
+        file->position = bytepos;
+    }
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return ok;
 }
 
-unsigned long write_file(File file, void *buf, unsigned long numbytes){
-    uint32_t position = file->position;
-    FileMode mode = file->mode;
-    Inode inode = file->inode;
-    DirectoryEntry dir = file->dir;
-    uint16_t d_block = file->dir_block;
+unsigned long file_length(File file){
     fserror = FS_NONE;
-
-    if(dir.open)
+    if(file == NULL || file->dir.open == 0)
     {
         fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    else if (mode == READ_ONLY)
+    FSState *saved = enter_fs(file->fs);
+    fs_rdlock(file_lock(file));
+    unsigned long size = file->inode.file_size;
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return size;
+}
+
+int set_read_ahead(File file, unsigned long blocks){
+    fserror = FS_NONE;
+    if(file == NULL || file->dir.open == 0)
     {
-        fserror = FS_FILE_READ_ONLY;
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    else if (file_length(file) + numbytes > MAX_FILE_SIZE)
+    if(blocks > MAX_VECTOR_BLOCKS)
     {
-        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        blocks = MAX_VECTOR_BLOCKS;
     }
-    else
-    {
-        uint32_t blocknumber = 0;
-        while(numbytes > 0)
-        {
-            //potential sizing issues here
-            char buf1[4096];
-            bzero(buf1, 4096);
-            read_sd_block(buf1, inode.blocks[blocknumber]);
-            unsigned long x = sizeof(&buf1);
-            memcpy(&buf, &buf1, x);
-            numbytes -= x;
-            blocknumber += 1;
-        }
-        fserror = FS_NONE;
-        return numbytes;
-    }  
-    return numbytes; 
+    FSState *saved = enter_fs(file->fs);
+    fs_wrlock(file_lock(file));
+    free_read_ahead(file);
+    file->ra_window = blocks;
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
+    return 1;
 }
 
-int seek_file(File file, unsigned long bytepos){
+void get_read_ahead_stats(File file, ReadAheadStats *stats){
     fserror = FS_NONE;
-    if(bytepos >= MAX_FILE_SIZE)
+    if(file == NULL || file->dir.open == 0)
     {
-        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
-        return 0;
-    }
-    else {
-        //file->position = bytepos;
-        fserror = FS_NONE;
-        return 1;
+        fserror = FS_FILE_NOT_OPEN;
+        bzero(stats, sizeof(*stats));
+        return;
     }
+    FSState *saved = enter_fs(file->fs);
+    fs_rdlock(file_lock(file));
+    *stats = file->ra_stats;
+    fs_rwunlock(file_lock(file));
+    enter_fs(saved);
 }
 
-unsigned long file_length(File file){
-    if(!file_exists(file->dir.file_name))
+//the body of delete_file().  The caller holds dir_lock.
+static int remove_dir_entry(char *name)
+{
+    //look up the file in the directory
+    uint32_t index;
+    DirectoryEntry dir;
+    if(!find_dir_entry(name, &index, &dir))
     {
         fserror = FS_FILE_NOT_FOUND;
         return 0;
     }
-    else
+    else if(dir.open)
+    {
+        fserror = FS_FILE_OPEN;
+        return 0;
+    }
+
+    //free every extent, then the blocks holding the spill-over
+    Inode node;
+    read_inode(dir.inode_index, &node);
+    LeafList leaves;
+    Extent *extents = malloc((node.num_extents ? node.num_extents : 1) * sizeof(Extent));
+    if(!extents || !load_extents(&node, extents, &leaves))
     {
-        fserror = FS_NONE;
-        return file->inode.file_size;
+        free(extents);
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    for(uint32_t i = 0; i < node.num_extents; i++)
+    {
+        if(extents[i].start != 0)
+        {
+            free_data_run(extents[i].start, extents[i].length);
+        }
+    }
+    free(extents);
+    if(node.indirect != 0)
+    {
+        free_data_run(node.indirect, 1);
     }
+    if(node.double_indirect != 0)
+    {
+        for(uint32_t j = 0; j < NUM_LEAF_BLOCKS && leaves.blocks[j] != 0; j++)
+        {
+            free_data_run(leaves.blocks[j], 1);
+        }
+        free_data_run(node.double_indirect, 1);
+    }
+    release_to_bitmap(&fs->inode_alloc, dir.inode_index);
+
+    //clear the directory entry
+    bzero(&dir, sizeof(dir));
+    write_dir_entry(index, &dir);
+    return 1;
 }
 
 int delete_file(char *name){
     fserror = FS_NONE;
-    //search through directory entries for file
-    for (int i = 6; i < 69; i++)
-    {
-        char buf1[4096];
-        bzero(buf1, 4096);
-        //read entry at i into buf
-        read_sd_block(buf1, i);
-
-        //create directory entry and copy data from entry i into it 
-        DirectoryEntry *dir;
-        memcpy(&dir, &buf1, sizeof(dir));
-
-        //is there a matching filename?
-        if(strcmp(dir->file_name, name))
-        {
-            //if so, clear it in the software disk
-            //set name to 0
-            strcpy(dir->file_name, "\0");
-            memcpy(&buf1, &dir, 4096);
-            write_sd_block(buf1, i);
-            return 1;
-        }
+    if(!ensure_mounted())
+    {
+        return 0;
     }
-    fserror = FS_FILE_NOT_FOUND;
-    return 0;
+    fs_lock(&fs->dir_lock);
+    int ok = remove_dir_entry(name);
+    if(ok)
+    {
+        note_metadata_op();
+    }
+    fs_unlock(&fs->dir_lock);
+    return ok;
 }
 
 int file_exists(char *name){
     fserror = FS_NONE;
-    //go through directory entries for file
-    for (int i = 6; i < 69; i++)
+    if(!ensure_mounted())
     {
-        //read block
-        char buf1[4096];
-        bzero(buf1, 4096);
-        read_sd_block(buf1, i);
-
-        //create directory entry and copy data into it 
-        DirectoryEntry *dir;
-        memcpy(&dir, &buf1, sizeof(dir));
-
-        //is there a matching filename?
-        if(strcmp(dir->file_name, name))
-        {
-            return 1;
-        }
-        else
-        {
-            return 0;
-        }
+        return 0;
     }
-    return 0;
+    uint32_t index;
+    DirectoryEntry dir;
+    fs_lock(&fs->dir_lock);
+    int found = find_dir_entry(name, &index, &dir);
+    fs_unlock(&fs->dir_lock);
+    return found;
 }
 
 void fs_print_error(void){
@@ -477,6 +3188,9 @@ void fs_print_error(void){
         case FS_IO_ERROR:
             printf("FS ERROR: Something really bad happened. \n");
             break;
+        case FS_NOT_FORMATTED:
+            printf("FS ERROR: Disk is not formatted for this filesystem version. \n");
+            break;
         default:
             printf("FS ERROR: Unknown error. \n");
             break;
@@ -489,9 +3203,14 @@ int check_structure_alignment(void){
     printf("Inode block size is: %lu.\n", sizeof(InodeBlock));
     printf("Directory Entry size is: %lu.\n", sizeof(DirectoryEntry));
     printf("Bitmap size is: %lu.\n", sizeof(Bitmap));
+    printf("Journal block size is: %lu.\n", sizeof(JournalBlock));
+    printf("Superblock size is: %lu.\n", sizeof(SuperblockBlock));
+    printf("Leaf list size is: %lu.\n", sizeof(LeafList));
 
-    if(sizeof(Inode) != 32 || sizeof(IndirectBlock) != 4096 || sizeof(InodeBlock) != 4096 
-    || sizeof(DirectoryEntry) != 512 || sizeof(Bitmap) != 4096) 
+    if(sizeof(Inode) != 64 || sizeof(IndirectBlock) != SOFTWARE_DISK_BLOCK_SIZE
+    || sizeof(InodeBlock) != SOFTWARE_DISK_BLOCK_SIZE || sizeof(DirectoryEntry) != 512
+    || sizeof(Bitmap) != SOFTWARE_DISK_BLOCK_SIZE || sizeof(JournalBlock) != SOFTWARE_DISK_BLOCK_SIZE
+    || sizeof(SuperblockBlock) != SOFTWARE_DISK_BLOCK_SIZE || sizeof(LeafList) != SOFTWARE_DISK_BLOCK_SIZE) 
     {
         return 0;
     }
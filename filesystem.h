@@ -6,12 +6,21 @@
 #if ! defined(__FILESYSTEM_4103_H__)
 #define __FILESYSTEM_4103_H__
 
+#include "fslock.h"
+
 // private
 struct FileInternals;
 
 // file type used by user code
 typedef struct FileInternals* File;
 
+// private
+struct FSState;
+
+// filesystem type used by user code.  Each filesystem lives on its own
+// software disk with its own block cache.
+typedef struct FSState* Filesystem;
+
 // access mode for open_file() 
 typedef enum {
 	READ_ONLY, READ_WRITE
@@ -29,19 +38,123 @@ typedef enum  {
   FS_FILE_ALREADY_EXISTS,  // attempted creation of file with existing name
   FS_EXCEEDS_MAX_FILE_SIZE,// seek or write would exceed max file size
   FS_ILLEGAL_FILENAME,     // filename begins with a null character
-  FS_IO_ERROR              // something really bad happened
+  FS_IO_ERROR,             // something really bad happened
+  FS_NOT_FORMATTED         // the disk holds no filesystem of this version
 } FSError;
 
+// read-ahead counters for one open file
+typedef struct ReadAheadStats {
+  unsigned long prefetched;  // blocks read before they were asked for
+  unsigned long hits;        // prefetched blocks that a later read used
+} ReadAheadStats;
+
+// metadata commit counters since the filesystem was mounted or
+// reset_commit_stats() was last called.  The mean batch is
+// operations / commits and the mean latency total_usecs / commits.
+typedef struct CommitStats {
+  unsigned long commits;           // journal transactions written
+  unsigned long operations;        // open/create/close/delete calls they carried
+  unsigned long max_batch;         // most operations in one transaction
+  unsigned long blocks;            // metadata blocks written
+  unsigned long long total_usecs;  // time spent committing
+  unsigned long long max_usecs;    // slowest commit
+} CommitStats;
+
 // function prototypes for filesystem API
 
+// A process can have several filesystems open at once.  Calls that take
+// a name, such as mount_fs() or open_file(), act on the calling thread's
+// current filesystem, which is the one in "sdprivate.sd" until the thread
+// picks another with use_fs().  Calls that take a File act on the
+// filesystem the file is on, whatever the thread's current one is.
+
+// makes a handle for the filesystem on the software disk backed by the
+// file at 'path'.  Nothing is read or created until the filesystem is
+// used.  Returns NULL on error.  Always sets 'fserror' global.
+Filesystem open_fs(const char *path);
+
+// like open_fs(), but the software disk is striped over the 'nfiles'
+// backing files at 'paths', 'stripe_blocks' blocks at a time (0 for the
+// default), so large reads and writes are spread over every file.  See
+// new_striped_software_disk().  Returns NULL on error.  Always sets
+// 'fserror' global.
+Filesystem open_striped_fs(const char **paths, unsigned long nfiles, unsigned long stripe_blocks);
+
+// unmounts 'fs', writes back its block cache and frees its handle.  A
+// thread whose current filesystem it was goes back to the default one,
+// which can't be closed.  Fails with FS_FILE_OPEN if any of its files
+// is still open.  Returns 1 on success, 0 on failure.  Always sets
+// 'fserror' global.
+int close_fs(Filesystem fs);
+
+// makes 'fs' the calling thread's current filesystem, along with its
+// software disk and block cache; NULL selects the default filesystem.
+// Returns the filesystem that was current, so it can be restored.
+Filesystem use_fs(Filesystem fs);
+
+// mounts the filesystem on the software disk, loading the bitmaps, inode
+// table and directory into memory so metadata operations don't touch the
+// disk.  The other functions mount automatically if this hasn't been
+// called.  Returns 1 on success, 0 on failure.  Always sets 'fserror'
+// global.
+int mount_fs(void);
+
+// formats the software disk as a filesystem of 'num_blocks' blocks
+// holding up to 'max_files' files, destroying any existing data.  The
+// layout is recorded in a superblock and derived from it at mount.  A
+// disk that is all zeros is formatted with 512 files when it is first
+// mounted.  Fails with FS_FILE_OPEN if any file is open, and with
+// FS_OUT_OF_SPACE if the disk is too small for the metadata.  Returns 1
+// on success, 0 on failure.  Always sets 'fserror' global.
+int format_fs(unsigned long num_blocks, unsigned long max_files);
+
+// like format_fs(), but keeps the size of the existing software disk
+// and only rewrites its superblock, bitmaps, inode table, directory and
+// journal header.  The data blocks are left as they are, so the time
+// taken doesn't grow with the disk.  Fails with FS_NOT_FORMATTED if
+// there is no software disk.  Returns 1 on success, 0 on failure.
+// Always sets 'fserror' global.
+int quick_format_fs(unsigned long max_files);
+
+// writes back all dirty metadata and cached blocks, then forgets the
+// in-memory state.  Fails with FS_FILE_OPEN if any file is still open.
+// Returns 1 on success, 0 on failure.  Always sets 'fserror' global.
+int unmount_fs(void);
+
+// writes back buffered file data, all dirty metadata and cached blocks
+// and forces them to stable storage.  This is the durability barrier:
+// everything done before it survives a crash.  Returns 1 on success, 0 on
+// failure.  Always sets 'fserror' global.
+int sync_fs(void);
+
+// turns on group commit.  Metadata changes are kept in memory and, by
+// default, only committed by sync_fs(), unmount_fs() or program exit.
+// With group commit the changes of many open/create/close/delete calls
+// are merged into one journal transaction once 'max_ops' calls are
+// pending or 'max_usecs' microseconds have passed since the oldest of
+// them, whichever comes first; the window is checked as calls are made.
+// 0 disables a limit, so (0, 0) restores the default.  Returns 1 on
+// success, 0 on failure.  Always sets 'fserror' global.
+int set_group_commit(unsigned long max_ops, unsigned long max_usecs);
+
+// copies the metadata commit counters into 'stats'.  Always sets
+// 'fserror' global.
+void get_commit_stats(CommitStats *stats);
+
+// zeroes the metadata commit counters, so a run can be measured on its
+// own.  Always sets 'fserror' global.
+void reset_commit_stats(void);
+
 // open existing file with pathname 'name' and access mode 'mode'.
 // Current file position is set to byte 0.  Returns NULL on
 // error. Always sets 'fserror' global.
 File open_file(char *name, FileMode mode);
 
 // create and open new file with pathname 'name' and (implied) access
-// mode READ_WRITE.  Current file position is set to byte 0.  Returns
-// NULL on error. Always sets 'fserror' global.
+// mode READ_WRITE.  Current file position is set to byte 0.  The data
+// of a file that fits in what its name leaves of the directory entry
+// (506 bytes less the name length) is kept there, so tiny files use no
+// data blocks.  Returns NULL on error. Always sets 'fserror' global.
 File create_file(char *name);
 
 // close 'file'.  Always sets 'fserror' global.
@@ -55,20 +168,51 @@ unsigned long read_file(File file, void *buf, unsigned long numbytes);
 
 // write 'numbytes' of data from 'buf' into 'file' at the current file
 // position.  Returns the number of bytes written. On an out of space
-// error, the return value may be less than 'numbytes'.  Always sets
-// 'fserror' global.
+// error, the return value may be less than 'numbytes'.  Partial-block
+// writes are buffered and reach the disk when 'file' is read, synced or
+// closed, so running out of space can also be reported then.  Always
+// sets 'fserror' global.
 unsigned long write_file(File file, void *buf, unsigned long numbytes);
 
+// like read_file() and write_file(), but at byte 'offset' instead of the
+// current file position, which is neither used nor changed.  Positional
+// reads of one file don't exclude each other in the thread-safe build,
+// so a pool of threads can read one File in parallel.  Always sets
+// 'fserror' global.
+unsigned long pread_file(File file, void *buf, unsigned long numbytes, unsigned long offset);
+unsigned long pwrite_file(File file, void *buf, unsigned long numbytes, unsigned long offset);
+
+// turns bytes 'offset' .. 'offset'+'numbytes'-1 of 'file' into a hole:
+// they read as zeros and the data blocks wholly inside the range are
+// freed.  Blocks only partly inside it are zeroed in place.  The range
+// is clipped to the end of file and the file length doesn't change.
+// Returns 1 on success and 0 on failure.  Always sets 'fserror' global.
+int punch_hole(File file, unsigned long offset, unsigned long numbytes);
+
+// writes out the buffered data of 'file' and syncs the filesystem.
+// Returns 1 on success and 0 on failure.  Always sets 'fserror' global.
+int fsync_file(File file);
+
 // sets current position in file to 'bytepos', always relative to the
 // beginning of file.  Seeks past the current end of file should
-// extend the file. Returns 1 on success and 0 on failure.  Always
-// sets 'fserror' global.
+// extend the file.  The gap is a hole: it reads as zeros and gets no
+// data blocks until it is written.  Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
 int seek_file(File file, unsigned long bytepos);
 
 // returns the current length of the file in bytes. Always sets
 // 'fserror' global.
 unsigned long file_length(File file);
 
+// sets how many blocks are read ahead when 'file' is read sequentially
+// (at most 256; 0 turns read-ahead off).  Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
+int set_read_ahead(File file, unsigned long blocks);
+
+// copies the read-ahead counters of 'file' into 'stats'.  The prefetch
+// hit rate is hits / prefetched.  Always sets 'fserror' global.
+void get_read_ahead_stats(File file, ReadAheadStats *stats);
+
 // deletes the file named 'name', if it exists. Returns 1 on success,
 // 0 on failure.  Always sets 'fserror' global.
 int delete_file(char *name); 
@@ -87,8 +231,9 @@ void fs_print_error(void);
 // to ensure that everything will work correctly.
 int check_structure_alignment(void);
 
-// filesystem error code set (set by each filesystem function)
-extern FSError fserror;
+// filesystem error code set (set by each filesystem function).  Each
+// thread has its own in the thread-safe build.
+extern FS_THREAD_LOCAL FSError fserror;
 
 
 #endif
@@ -1,20 +1,64 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "softwaredisk.h"
 #include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
 #include "filesystem.c"
 #include "filesystem.h"
 
+// Usage: formatfs [blocks [files [block_size]]]
+//        formatfs -q [files]
+//
+// Defaults to a 4096-block disk holding 512 files.  The block size is
+// fixed when the software disk is compiled, so 'block_size' is only
+// checked against it.  The disk is created sparse, so only the blocks
+// the filesystem writes take up space.  -q quick formats the existing
+// disk instead, keeping its size and zeroing only the metadata.
+
+int main(int argc, char *argv[]) {
+    int quick = argc > 1 && strcmp(argv[1], "-q") == 0;
+    if(quick)
+    {
+        argc--;
+        argv++;
+    }
+    unsigned long blocks = argc > 1 && !quick ? strtoul(argv[1], NULL, 0) : 4096;
+    unsigned long files = argc > (quick ? 1 : 2) ? strtoul(argv[quick ? 1 : 2], NULL, 0) : 512;
+    unsigned long block_size = argc > 3 && !quick ? strtoul(argv[3], NULL, 0) : SOFTWARE_DISK_BLOCK_SIZE;
+
+    if(argc > (quick ? 2 : 4) || blocks == 0 || files == 0)
+    {
+        printf("usage: formatfs [blocks [files [block_size]]]\n");
+        printf("       formatfs -q [files]\n");
+        return 1;
+    }
+    if(block_size != SOFTWARE_DISK_BLOCK_SIZE)
+    {
+        printf("Block size must be %d, the size the software disk was built with.\n",
+               SOFTWARE_DISK_BLOCK_SIZE);
+        return 1;
+    }
 
-int main() {
     printf("Checking structure alignment...\n");
     if(!check_structure_alignment())
     {
         printf("Check failed. Do not use filesystem.\n");
+        return 1;
+    }
+    if(quick)
+    {
+        printf("Check succeeded. Quick formatting for %lu files.\n", files);
     }
     else
     {
-        printf("Check succeeded. Initializing software disk.\n");
-        init_software_disk();
+        printf("Check succeeded. Formatting %lu blocks for %lu files.\n", blocks, files);
+    }
+    if(!(quick ? quick_format_fs(files) : format_fs(blocks, files)))
+    {
+        fs_print_error();
+        return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,51 @@
+//
+// Locking primitives for the thread-safe build of the software disk, block
+// cache and filesystem.  Compile everything with -DFS_THREAD_SAFE -pthread
+// to get per-thread 'fserror'/'sderror' and real locks; otherwise the
+// locks compile away and the error codes are ordinary globals.
+//
+
+#if ! defined(__FSLOCK_4103_H__)
+#define __FSLOCK_4103_H__
+
+#if defined(FS_THREAD_SAFE)
+
+#include <pthread.h>
+
+typedef pthread_mutex_t FSLock;
+typedef pthread_rwlock_t FSRWLock;
+
+#define FS_THREAD_LOCAL _Thread_local
+#define FS_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define FS_RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#define fs_lock_init(l) pthread_mutex_init((l), NULL)
+#define fs_lock_destroy(l) pthread_mutex_destroy(l)
+#define fs_lock(l) pthread_mutex_lock(l)
+#define fs_unlock(l) pthread_mutex_unlock(l)
+#define fs_rwlock_init(l) pthread_rwlock_init((l), NULL)
+#define fs_rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define fs_rdlock(l) pthread_rwlock_rdlock(l)
+#define fs_wrlock(l) pthread_rwlock_wrlock(l)
+#define fs_rwunlock(l) pthread_rwlock_unlock(l)
+
+#else
+
+typedef int FSLock;
+typedef int FSRWLock;
+
+#define FS_THREAD_LOCAL
+#define FS_LOCK_INITIALIZER 0
+#define FS_RWLOCK_INITIALIZER 0
+#define fs_lock_init(l) ((void)(l))
+#define fs_lock_destroy(l) ((void)(l))
+#define fs_lock(l) ((void)(l))
+#define fs_unlock(l) ((void)(l))
+#define fs_rwlock_init(l) ((void)(l))
+#define fs_rwlock_destroy(l) ((void)(l))
+#define fs_rdlock(l) ((void)(l))
+#define fs_wrlock(l) ((void)(l))
+#define fs_rwunlock(l) ((void)(l))
+
+#endif
+
+#endif
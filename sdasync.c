@@ -0,0 +1,264 @@
+//
+// Asynchronous block requests for the software disk.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "softwaredisk.h"
+#include "sdasync.h"
+
+// carry out 'req' on the calling thread, against the disk it was
+// submitted for
+static void run_request(SDRequest *req) {
+  SoftwareDisk saved=use_software_disk(req->disk);
+
+  req->ok=req->write ? write_sd_blocks(req->buf, req->blocknum, req->count)
+                     : read_sd_blocks(req->buf, req->blocknum, req->count);
+  req->error=sderror;
+  use_software_disk(saved);
+}
+
+#if defined(FS_THREAD_SAFE)
+
+#define MAX_SD_WORKERS 64
+
+// internals of the worker pool
+typedef struct SDAsyncInternals {
+  pthread_mutex_t lock;
+  pthread_cond_t work;       // queue became non-empty or pool is stopping
+  pthread_cond_t finished;   // some request completed
+  SDRequest *head, *tail;    // queued requests, oldest first
+  unsigned long pending;     // queued or running requests
+  unsigned long nworkers;    // threads to join, changed under 'pool_lock'
+  unsigned long running;     // workers that haven't decided to exit
+  int stopping;
+  pthread_t workers[MAX_SD_WORKERS];
+} SDAsyncInternals;
+
+// GLOBALS
+
+static SDAsyncInternals sa = {
+  .lock=PTHREAD_MUTEX_INITIALIZER, .work=PTHREAD_COND_INITIALIZER,
+  .finished=PTHREAD_COND_INITIALIZER
+};
+
+// serializes starting and stopping the pool
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker_main(void *unused) {
+  SDCallback callback;
+  SDRequest *req;
+
+  (void)unused;
+  pthread_mutex_lock(&sa.lock);
+  for (;;) {
+    while (! sa.head && ! sa.stopping) {
+      pthread_cond_wait(&sa.work, &sa.lock);
+    }
+    if (! sa.head) {
+      break;
+    }
+    req=sa.head;
+    sa.head=req->next;
+    if (! sa.head) {
+      sa.tail=NULL;
+    }
+    pthread_mutex_unlock(&sa.lock);
+
+    run_request(req);
+    callback=req->callback;
+
+    pthread_mutex_lock(&sa.lock);
+    req->done=1;
+    sa.pending--;
+    pthread_cond_broadcast(&sa.finished);
+    if (callback) {
+      // from here on 'req' is the callback's, to free or resubmit
+      pthread_mutex_unlock(&sa.lock);
+      callback(req);
+      pthread_mutex_lock(&sa.lock);
+    }
+  }
+  // still holding the lock, so a submitter that saw this worker running
+  // has queued its request where the loop above found it
+  sa.running--;
+  pthread_mutex_unlock(&sa.lock);
+  return NULL;
+}
+
+// stops the workers once the queue is empty.  The caller holds
+// 'pool_lock'.
+static void stop_workers(void) {
+  unsigned long i;
+
+  pthread_mutex_lock(&sa.lock);
+  sa.stopping=1;
+  pthread_cond_broadcast(&sa.work);
+  pthread_mutex_unlock(&sa.lock);
+  for (i=0; i < sa.nworkers; i++) {
+    pthread_join(sa.workers[i], NULL);
+  }
+  sa.nworkers=0;
+  pthread_mutex_lock(&sa.lock);
+  sa.stopping=0;
+  pthread_mutex_unlock(&sa.lock);
+}
+
+// starts 'nthreads' workers in a stopped pool.  The caller holds
+// 'pool_lock'.
+static int start_workers(unsigned long nthreads) {
+  static int registered=0;
+  unsigned long i;
+
+  for (i=0; i < nthreads; i++) {
+    pthread_mutex_lock(&sa.lock);
+    sa.running++;
+    pthread_mutex_unlock(&sa.lock);
+    if (pthread_create(&sa.workers[i], NULL, worker_main, NULL) != 0) {
+      pthread_mutex_lock(&sa.lock);
+      sa.running--;
+      pthread_mutex_unlock(&sa.lock);
+      break;
+    }
+    sa.nworkers++;
+  }
+  if (! registered) {
+    atexit(stop_sd_async);
+    registered=1;
+  }
+  return sa.nworkers > 0;
+}
+
+// (re)starts the worker pool with 'nthreads' workers.  The wait for
+// queued requests happens outside 'pool_lock', so callbacks that submit
+// more requests meanwhile aren't held up.
+int start_sd_async(unsigned long nthreads) {
+  int ret;
+
+  if (nthreads == 0 || nthreads > MAX_SD_WORKERS) {
+    return 0;
+  }
+  drain_sd_requests();
+  pthread_mutex_lock(&pool_lock);
+  stop_workers();
+  ret=start_workers(nthreads);
+  pthread_mutex_unlock(&pool_lock);
+  return ret;
+}
+
+// queues 'req' for the worker pool, starting it if no worker is running.
+// A callback runs on a worker, which counts as running, so it never
+// needs 'pool_lock' to submit.
+int submit_sd_request(SDRequest *req) {
+  int ret=1;
+
+  req->done=0;
+  req->ok=0;
+  req->error=SD_NONE;
+  req->disk=current_software_disk();
+  req->next=NULL;
+
+  pthread_mutex_lock(&sa.lock);
+  while (sa.running == 0) {
+    pthread_mutex_unlock(&sa.lock);
+    // a pool that is stopping has to finish first
+    pthread_mutex_lock(&pool_lock);
+    if (sa.nworkers == 0) {
+      ret=start_workers(DEFAULT_SD_WORKERS);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (! ret) {
+      return 0;
+    }
+    pthread_mutex_lock(&sa.lock);
+  }
+  if (sa.tail) {
+    sa.tail->next=req;
+  }
+  else {
+    sa.head=req;
+  }
+  sa.tail=req;
+  sa.pending++;
+  pthread_cond_signal(&sa.work);
+  pthread_mutex_unlock(&sa.lock);
+  return 1;
+}
+
+// returns 1 if 'req' has completed.
+int poll_sd_request(SDRequest *req) {
+  int done;
+
+  pthread_mutex_lock(&sa.lock);
+  done=req->done;
+  pthread_mutex_unlock(&sa.lock);
+  return done;
+}
+
+// waits for 'req' to complete.
+int wait_sd_request(SDRequest *req) {
+  pthread_mutex_lock(&sa.lock);
+  while (! req->done) {
+    pthread_cond_wait(&sa.finished, &sa.lock);
+  }
+  pthread_mutex_unlock(&sa.lock);
+  sderror=req->error;
+  return req->ok;
+}
+
+// waits for every request submitted so far to complete.
+void drain_sd_requests(void) {
+  pthread_mutex_lock(&sa.lock);
+  while (sa.pending > 0) {
+    pthread_cond_wait(&sa.finished, &sa.lock);
+  }
+  pthread_mutex_unlock(&sa.lock);
+}
+
+// waits for queued requests, then stops the worker threads.  Callbacks
+// still running are waited for too.
+void stop_sd_async(void) {
+  drain_sd_requests();
+  pthread_mutex_lock(&pool_lock);
+  stop_workers();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+// without threads every request is carried out as it is submitted
+
+int start_sd_async(unsigned long nthreads) {
+  (void)nthreads;
+  return 1;
+}
+
+int submit_sd_request(SDRequest *req) {
+  SDCallback callback=req->callback;
+
+  req->disk=current_software_disk();
+  req->next=NULL;
+  run_request(req);
+  req->done=1;
+  if (callback) {
+    callback(req);
+  }
+  return 1;
+}
+
+int poll_sd_request(SDRequest *req) {
+  return req->done;
+}
+
+int wait_sd_request(SDRequest *req) {
+  sderror=req->error;
+  return req->ok;
+}
+
+void drain_sd_requests(void) {
+}
+
+void stop_sd_async(void) {
+}
+
+#endif
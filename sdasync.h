@@ -0,0 +1,70 @@
+//
+// Asynchronous block requests for the software disk.  Requests are queued
+// and carried out by a pool of worker threads, so callers can keep many
+// block transfers in flight and overlap them with computation.  Workers
+// only exist in the thread-safe build (-DFS_THREAD_SAFE -pthread);
+// otherwise each request is carried out as it is submitted.
+//
+
+#if ! defined(__SDASYNC_4103_H__)
+#define __SDASYNC_4103_H__
+
+#include "softwaredisk.h"
+
+// worker threads started when requests are first submitted
+#define DEFAULT_SD_WORKERS 4
+
+struct SDRequest;
+
+// called on a worker thread when 'req' has finished, after it is marked
+// done.  The request is the callback's from then on: it may free it or
+// submit it again.  Such a request shouldn't also be waited on, as a
+// waiter can return before the callback runs.
+typedef void (*SDCallback)(struct SDRequest *req);
+
+// a block request.  The caller owns it and fills in the first group of
+// fields; it doubles as the completion token and must stay put until the
+// request has completed.
+typedef struct SDRequest {
+  int write;                 // 1 to write 'buf' to the disk, 0 to read into it
+  void *buf;                 // count * SOFTWARE_DISK_BLOCK_SIZE bytes
+  unsigned long blocknum;    // first block
+  unsigned long count;       // consecutive blocks
+  SDCallback callback;       // may be NULL
+  void *arg;                 // for the caller's use
+
+  // set when the request completes
+  int done;                  // read with poll_sd_request()
+  int ok;                    // 1 if the transfer succeeded
+  SDError error;             // 'sderror' of the transfer
+
+  SoftwareDisk disk;         // private: the submitter's disk
+  struct SDRequest *next;    // private
+} SDRequest;
+
+// function prototypes for asynchronous software disk API
+
+// (re)starts the worker pool with 'nthreads' workers, waiting for queued
+// requests first.  Submitting a request starts DEFAULT_SD_WORKERS workers
+// if this hasn't been called.  Returns 1 on success, otherwise 0.
+int start_sd_async(unsigned long nthreads);
+
+// queues 'req' for the calling thread's software disk.  Returns 1 if it
+// was queued, otherwise 0 and the request is not touched.
+int submit_sd_request(SDRequest *req);
+
+// returns 1 if 'req' has completed, otherwise 0.  Never blocks.
+int poll_sd_request(SDRequest *req);
+
+// waits for 'req' to complete.  Returns req->ok and sets 'sderror' to
+// req->error.
+int wait_sd_request(SDRequest *req);
+
+// waits for every request submitted so far to complete.  Their callbacks
+// may still be running.
+void drain_sd_requests(void);
+
+// waits for queued requests, then stops the worker threads.
+void stop_sd_async(void);
+
+#endif
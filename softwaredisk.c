@@ -5,126 +5,1069 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
 #include "softwaredisk.h"
 
-#define NUM_BLOCKS 4096
+#define NUM_BLOCKS 4096 // size of a disk made by init_software_disk()
 #define BACKING_STORE "sdprivate.sd"
 
+#if ! defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+// glibc only names O_DIRECT for _GNU_SOURCE, which the programs that
+// include this file don't define
+#if ! defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+
+#define DIRECT_ALIGN 4096     // memory alignment direct transfers need
+#define MAX_ALIGNED_FREE 256  // aligned blocks a disk keeps for reuse
+
+// one of the backing files of a striped disk
+typedef struct Stripe {
+  char *path;
+  int fd;              // -1 while the disk is closed
+  unsigned long nblocks; // blocks in the file
+} Stripe;
+
+// the share of a transfer that falls in one stripe
+typedef struct StripeJob {
+  int write;
+  int fd;              // the stripe's backing file
+  void **bufs;
+  unsigned long *blocknums; // blocks within the stripe's file
+  unsigned long count;
+  int ok;              // the transfer succeeded
+  int done;            // a worker has finished it
+  struct StripeJob *next;
+} StripeJob;
+
 // internals of software disk implementation
 typedef struct SoftwareDiskInternals {
-  FILE *fp;       
+  SDBackend backend;   // how the backing store is accessed
+  FILE *fp;            // SD_BACKEND_STDIO
+  int fd;              // SD_BACKEND_MMAP and SD_BACKEND_DIRECT
+  char *map;           // SD_BACKEND_MMAP, 'nblocks' blocks
+  unsigned long nblocks; // size of the open or last formatted disk
+  char *path;          // backing store
+  FSRWLock lock;       // held for writing to open, close or reformat the
+                       // backing store, and for reading by block transfers,
+                       // which use positional I/O and so run side by side
+  FSLock gate;         // taken on the way into 'lock', so a waiting writer
+                       // holds off new transfers instead of starving
+  void *aligned_free;  // SD_BACKEND_DIRECT: blocks for staging unaligned
+                       // buffers, linked through their first word
+  unsigned long aligned_nfree; // blocks in 'aligned_free'
+  FSLock aligned_lock; // guards 'aligned_free'
+  unsigned long nstripes; // files the blocks are striped over, 0 for 'path'
+  unsigned long stripe_unit; // consecutive blocks kept in one file
+  Stripe *stripes;     // nstripes of them
+#if defined(FS_THREAD_SAFE)
+  pthread_mutex_t pool_lock; // guards the fields below
+  pthread_cond_t work; // a job was queued or the workers are stopping
+  pthread_cond_t finished; // some job completed
+  StripeJob *head, *tail; // queued jobs, oldest first
+  pthread_t *workers;  // nstripes - 1 of them while the disk is open
+  unsigned long nworkers;
+  int stopping;
+#endif
 } SoftwareDiskInternals;
 
 // GLOBALS
 
-static SoftwareDiskInternals sd;
+static SoftwareDiskInternals default_sd = {
+  .backend=SD_BACKEND_STDIO, .fd=-1, .nblocks=NUM_BLOCKS, .path=BACKING_STORE,
+  .lock=FS_RWLOCK_INITIALIZER, .gate=FS_LOCK_INITIALIZER,
+  .aligned_lock=FS_LOCK_INITIALIZER
+};
+
+// the disk the calling thread's software disk calls act on
+static FS_THREAD_LOCAL SoftwareDiskInternals *sd = &default_sd;
 
 // software disk error code set (set by each software disk function).
-SDError sderror;
+FS_THREAD_LOCAL SDError sderror;
 
-// initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
-int init_software_disk() {
-  int i;
-  char block[SOFTWARE_DISK_BLOCK_SIZE];
-  sderror=SD_NONE;
-  sd.fp=fopen(BACKING_STORE, "w+");
-  if (! sd.fp) {
-    sderror=SD_INTERNAL_ERROR;
+// issues one preadv/pwritev on 'fd' for the contiguous run of 'n' blocks
+// starting at 'first', retrying on short transfers.  Returns 1 on success.
+static int transfer_run(int fd, int write, struct iovec *iov, int n, unsigned long first) {
+  off_t offset=(off_t)first * SOFTWARE_DISK_BLOCK_SIZE;
+  ssize_t ret;
+
+  while (n > 0) {
+    ret=write ? pwritev(fd, iov, n, offset)
+              : preadv(fd, iov, n, offset);
+    if (ret <= 0) {
+      return 0;
+    }
+    offset+=ret;
+    while (n > 0 && (size_t)ret >= iov->iov_len) {
+      ret-=iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base=(char *)iov->iov_base + ret;
+      iov->iov_len-=ret;
+    }
+  }
+  return 1;
+}
+
+// moves 'count' blocks between 'bufs' and blocks 'blocknums' of the file
+// open as 'fd', coalescing runs of consecutive block numbers into single
+// vectored transfers.  Returns 1 on success.
+static int transfer_vector(int fd, int write, void **bufs, unsigned long *blocknums,
+                           unsigned long count) {
+  struct iovec iov[IOV_MAX];
+  unsigned long i=0, first;
+  int n;
+
+  while (i < count) {
+    first=blocknums[i];
+    n=0;
+    do {
+      iov[n].iov_base=bufs[i];
+      iov[n].iov_len=SOFTWARE_DISK_BLOCK_SIZE;
+      n++;
+      i++;
+    } while (i < count && n < IOV_MAX && blocknums[i] == first + n);
+    if (! transfer_run(fd, write, iov, n, first)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// returns the stripe block 'blocknum' of a striped disk lives in and sets
+// 'within' to its block number in that stripe's file
+static unsigned long stripe_of(unsigned long blocknum, unsigned long *within) {
+  unsigned long unit=blocknum / sd->stripe_unit;
+
+  *within=unit / sd->nstripes * sd->stripe_unit + blocknum % sd->stripe_unit;
+  return unit % sd->nstripes;
+}
+
+// returns how many blocks of a striped disk of 'nblocks' blocks stripe
+// 's' holds
+static unsigned long stripe_size(unsigned long s, unsigned long nblocks) {
+  unsigned long row=sd->nstripes * sd->stripe_unit;
+  unsigned long rest=nblocks % row;
+  unsigned long extra=rest > s * sd->stripe_unit ? rest - s * sd->stripe_unit : 0;
+
+  return nblocks / row * sd->stripe_unit + (extra < sd->stripe_unit ? extra : sd->stripe_unit);
+}
+
+static void run_stripe_job(StripeJob *job) {
+  job->ok=transfer_vector(job->fd, job->write, job->bufs, job->blocknums, job->count);
+}
+
+#if defined(FS_THREAD_SAFE)
+
+#define MAX_STRIPE_WORKERS 64
+
+// carries out the jobs queued on 'arg', a striped disk, until its
+// workers are stopped
+static void *stripe_worker(void *arg) {
+  SoftwareDiskInternals *disk=arg;
+  StripeJob *job;
+
+  pthread_mutex_lock(&disk->pool_lock);
+  for (;;) {
+    while (! disk->head && ! disk->stopping) {
+      pthread_cond_wait(&disk->work, &disk->pool_lock);
+    }
+    if (! disk->head) {
+      break;
+    }
+    job=disk->head;
+    disk->head=job->next;
+    if (! disk->head) {
+      disk->tail=NULL;
+    }
+    pthread_mutex_unlock(&disk->pool_lock);
+
+    run_stripe_job(job);
+
+    pthread_mutex_lock(&disk->pool_lock);
+    job->done=1;
+    pthread_cond_broadcast(&disk->finished);
+  }
+  pthread_mutex_unlock(&disk->pool_lock);
+  return NULL;
+}
+
+// starts a worker for every stripe but one, since the thread making a
+// transfer does one share itself.  If no worker starts, transfers run on
+// the calling thread alone.  The caller holds the disk's lock.
+static void start_stripe_workers(void) {
+  unsigned long want=sd->nstripes - 1 < MAX_STRIPE_WORKERS ? sd->nstripes - 1 : MAX_STRIPE_WORKERS;
+  unsigned long i;
+
+  if (want == 0 || ! (sd->workers=malloc(want * sizeof(pthread_t)))) {
+    return;
+  }
+  for (i=0; i < want; i++) {
+    if (pthread_create(&sd->workers[i], NULL, stripe_worker, sd) != 0) {
+      break;
+    }
+    sd->nworkers++;
+  }
+}
+
+// stops the workers once the jobs queued so far are done.  The caller
+// holds the disk's lock.
+static void stop_stripe_workers(void) {
+  unsigned long i;
+
+  pthread_mutex_lock(&sd->pool_lock);
+  sd->stopping=1;
+  pthread_cond_broadcast(&sd->work);
+  pthread_mutex_unlock(&sd->pool_lock);
+  for (i=0; i < sd->nworkers; i++) {
+    pthread_join(sd->workers[i], NULL);
+  }
+  free(sd->workers);
+  sd->workers=NULL;
+  sd->nworkers=0;
+  sd->stopping=0;
+}
+
+// carries out the 'n' jobs in 'jobs', all but the first on the workers.
+// Returns 1 if every one succeeded.
+static int run_stripe_jobs(StripeJob **jobs, unsigned long n) {
+  unsigned long i;
+  int ok=1;
+
+  if (sd->nworkers == 0 || n < 2) {
+    for (i=0; i < n; i++) {
+      run_stripe_job(jobs[i]);
+      ok&=jobs[i]->ok;
+    }
+    return ok;
+  }
+
+  pthread_mutex_lock(&sd->pool_lock);
+  for (i=1; i < n; i++) {
+    jobs[i]->done=0;
+    jobs[i]->next=NULL;
+    if (sd->tail) {
+      sd->tail->next=jobs[i];
+    }
+    else {
+      sd->head=jobs[i];
+    }
+    sd->tail=jobs[i];
+  }
+  pthread_cond_broadcast(&sd->work);
+  pthread_mutex_unlock(&sd->pool_lock);
+
+  run_stripe_job(jobs[0]);
+  ok=jobs[0]->ok;
+
+  pthread_mutex_lock(&sd->pool_lock);
+  for (i=1; i < n; i++) {
+    while (! jobs[i]->done) {
+      pthread_cond_wait(&sd->finished, &sd->pool_lock);
+    }
+    ok&=jobs[i]->ok;
+  }
+  pthread_mutex_unlock(&sd->pool_lock);
+  return ok;
+}
+
+#else
+
+// without threads the shares are transferred one after another
+
+static void start_stripe_workers(void) {
+}
+
+static void stop_stripe_workers(void) {
+}
+
+static int run_stripe_jobs(StripeJob **jobs, unsigned long n) {
+  unsigned long i;
+  int ok=1;
+
+  for (i=0; i < n; i++) {
+    run_stripe_job(jobs[i]);
+    ok&=jobs[i]->ok;
+  }
+  return ok;
+}
+
+#endif
+
+// releases whatever the current backend holds open
+static void close_backing_store(void) {
+  unsigned long s;
+
+  if (sd->nstripes > 0) {
+    stop_stripe_workers();
+    for (s=0; s < sd->nstripes; s++) {
+      if (sd->stripes[s].fd >= 0) {
+        close(sd->stripes[s].fd);
+        sd->stripes[s].fd=-1;
+      }
+    }
+  }
+  if (sd->fp) {
+    fclose(sd->fp);
+    sd->fp=NULL;
+  }
+  if (sd->map) {
+    munmap(sd->map, (size_t)sd->nblocks * SOFTWARE_DISK_BLOCK_SIZE);
+    sd->map=NULL;
+  }
+  if (sd->fd >= 0) {
+    close(sd->fd);
+    sd->fd=-1;
+  }
+}
+
+// sets 'sd->nblocks' from the size of the backing store open as 'fd'.
+// Returns 0 unless it holds a whole, non-zero number of blocks.
+static int size_backing_store(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size % SOFTWARE_DISK_BLOCK_SIZE != 0) {
     return 0;
   }
-  
-  bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
-  for (i=0; i < NUM_BLOCKS; i++) {
-    if (fwrite(block, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-      fclose(sd.fp);
-      sd.fp=NULL;
+  sd->nblocks=st.st_size / SOFTWARE_DISK_BLOCK_SIZE;
+  return 1;
+}
+
+// opens the backing file at 'path' with 'flags' the way the current
+// backend needs.  The direct backend bypasses the page cache, with
+// O_DIRECT or, on macOS, F_NOCACHE.  Returns the descriptor, or -1.
+static int open_backing_file(const char *path, int flags) {
+  int fd;
+
+  if (sd->backend == SD_BACKEND_DIRECT) {
+#if defined(O_DIRECT)
+    flags|=O_DIRECT;
+#elif ! defined(F_NOCACHE)
+    return -1;
+#endif
+  }
+  fd=open(path, flags, 0666);
+#if ! defined(O_DIRECT) && defined(F_NOCACHE)
+  if (fd >= 0 && sd->backend == SD_BACKEND_DIRECT && fcntl(fd, F_NOCACHE, 1) != 0) {
+    close(fd);
+    fd=-1;
+  }
+#endif
+  return fd;
+}
+
+// opens the backing files of a striped disk if they aren't open already
+// and sets 'sd->nblocks' from their sizes.  The caller holds the disk's
+// lock.  Returns 1 on success, otherwise 0 with 'sderror' set.
+static int open_stripes(void) {
+  struct stat st;
+  unsigned long s, total=0;
+
+  if (sd->stripes[0].fd >= 0) {
+    return 1;
+  }
+  for (s=0; s < sd->nstripes; s++) {
+    sd->stripes[s].fd=open_backing_file(sd->stripes[s].path, O_RDWR);
+    if (sd->stripes[s].fd < 0) {
+      close_backing_store();
       sderror=SD_INTERNAL_ERROR;
       return 0;
     }
+    if (fstat(sd->stripes[s].fd, &st) != 0 || st.st_size % SOFTWARE_DISK_BLOCK_SIZE != 0) {
+      close_backing_store();
+      sderror=SD_NOT_INIT;
+      return 0;
+    }
+    sd->stripes[s].nblocks=st.st_size / SOFTWARE_DISK_BLOCK_SIZE;
+    total+=sd->stripes[s].nblocks;
+  }
+
+  // each file must hold its share of a disk of that size, or the files
+  // aren't one disk striped this way
+  for (s=0; s < sd->nstripes; s++) {
+    if (total == 0 || sd->stripes[s].nblocks != stripe_size(s, total)) {
+      close_backing_store();
+      sderror=SD_NOT_INIT;
+      return 0;
+    }
   }
+  sd->nblocks=total;
+  start_stripe_workers();
   return 1;
 }
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
-unsigned long software_disk_size() {
+// creates the backing files of a striped disk of 'nblocks' blocks, each
+// sparse and sized for its share, and leaves them open.  The caller holds
+// the disk's lock.  Returns 1 on success, otherwise 0 with 'sderror' set.
+static int create_stripes(unsigned long nblocks) {
+  unsigned long s;
 
-  return NUM_BLOCKS;
+  for (s=0; s < sd->nstripes; s++) {
+    sd->stripes[s].nblocks=stripe_size(s, nblocks);
+    sd->stripes[s].fd=open_backing_file(sd->stripes[s].path, O_RDWR | O_CREAT | O_TRUNC);
+    if (sd->stripes[s].fd < 0
+        || ftruncate(sd->stripes[s].fd, (off_t)sd->stripes[s].nblocks * SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+      close_backing_store();
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+  }
+  start_stripe_workers();
+  return 1;
 }
 
-// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
-// on success or 0 on failure.  Always sets global 'sderror'.
-int write_sd_block(void *buf, unsigned long blocknum) {
+// opens an existing backing store for the current backend if it isn't
+// open already.  The caller holds the disk's lock.  Returns 1 on success,
+// otherwise 0 with 'sderror' set.
+static int open_backing_store_locked(void) {
+  if (sd->nstripes > 0) {
+    return open_stripes();
+  }
+  if (sd->backend == SD_BACKEND_STDIO) {
+    if (sd->fp) {
+      return 1;
+    }
+    sd->fp=fopen(sd->path, "r+");
+    if (! sd->fp) {             
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    if (! size_backing_store(fileno(sd->fp))) {
+      fclose(sd->fp);
+      sd->fp=0;
+      sderror=SD_NOT_INIT;
+      return 0;
+    }
+    return 1;
+  }
 
-  sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
+  if (sd->backend == SD_BACKEND_DIRECT) {
+    if (sd->fd >= 0) {
+      return 1;
+    }
+    sd->fd=open_backing_file(sd->path, O_RDWR);
+    if (sd->fd < 0) {
       sderror=SD_INTERNAL_ERROR;
       return 0;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
+    if (! size_backing_store(sd->fd)) {
+      close_backing_store();
+      sderror=SD_NOT_INIT;
+      return 0;
     }
+    return 1;
   }
 
-  if (blocknum > NUM_BLOCKS-1) {
+  if (sd->map) {
+    return 1;
+  }
+  sd->fd=open(sd->path, O_RDWR);
+  if (sd->fd < 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! size_backing_store(sd->fd)) {
+    close_backing_store();
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  sd->map=mmap(NULL, (size_t)sd->nblocks * SOFTWARE_DISK_BLOCK_SIZE,
+              PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+  if (sd->map == MAP_FAILED) {
+    sd->map=NULL;
+    close_backing_store();
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
+
+// takes the disk's lock, exclusively for 'write'
+static void lock_disk(int write) {
+  fs_lock(&sd->gate);
+  if (write) {
+    fs_wrlock(&sd->lock);
+  }
+  else {
+    fs_rdlock(&sd->lock);
+  }
+  fs_unlock(&sd->gate);
+}
+
+// returns 1 if the current backend's backing store is open.  The caller
+// holds the disk's lock.
+static int backing_store_open(void) {
+  if (sd->nstripes > 0) {
+    return sd->stripes[0].fd >= 0;
+  }
+  if (sd->backend == SD_BACKEND_STDIO) {
+    return sd->fp != NULL;
+  }
+  if (sd->backend == SD_BACKEND_DIRECT) {
+    return sd->fd >= 0;
+  }
+  return sd->map != NULL;
+}
+
+// takes the disk's lock for reading, opening the backing store first if
+// it isn't open, so it can't be closed or remapped under a transfer.
+// Returns 1 with the lock held, otherwise 0 with 'sderror' set.
+static int hold_backing_store(void) {
+  int ret;
+
+  for (;;) {
+    lock_disk(0);
+    if (backing_store_open()) {
+      return 1;
+    }
+    fs_rwunlock(&sd->lock);
+    lock_disk(1);
+    ret=open_backing_store_locked();
+    fs_rwunlock(&sd->lock);
+    if (! ret) {
+      return 0;
+    }
+  }
+}
+
+// makes a handle for the software disk backed by the file at 'path'.
+// Nothing is opened or created until the disk is used.  Returns NULL if
+// out of memory.
+SoftwareDisk new_software_disk(const char *path) {
+  SoftwareDisk disk=calloc(1, sizeof(SoftwareDiskInternals));
+
+  sderror=SD_NONE;
+  if (disk) {
+    disk->path=strdup(path);
+  }
+  if (! disk || ! disk->path) {
+    free(disk);
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  disk->backend=SD_BACKEND_STDIO;
+  disk->fd=-1;
+  disk->nblocks=NUM_BLOCKS;
+  fs_rwlock_init(&disk->lock);
+  fs_lock_init(&disk->gate);
+  fs_lock_init(&disk->aligned_lock);
+  return disk;
+}
+
+// makes a handle for a software disk whose blocks are striped over the
+// 'nfiles' backing files at 'paths', 'stripe_blocks' consecutive blocks
+// to a file (0 for DEFAULT_STRIPE_BLOCKS).  Returns NULL on failure.
+SoftwareDisk new_striped_software_disk(const char **paths, unsigned long nfiles,
+                                       unsigned long stripe_blocks) {
+  SoftwareDisk disk;
+  unsigned long s;
+
+  if (! paths || nfiles == 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  disk=new_software_disk(paths[0]);
+  if (! disk) {
+    return NULL;
+  }
+  disk->stripes=calloc(nfiles, sizeof(Stripe));
+  if (! disk->stripes) {
+    free_software_disk(disk);
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+#if defined(FS_THREAD_SAFE)
+  pthread_mutex_init(&disk->pool_lock, NULL);
+  pthread_cond_init(&disk->work, NULL);
+  pthread_cond_init(&disk->finished, NULL);
+#endif
+  disk->nstripes=nfiles;
+  disk->stripe_unit=stripe_blocks ? stripe_blocks : DEFAULT_STRIPE_BLOCKS;
+  for (s=0; s < nfiles; s++) {
+    disk->stripes[s].fd=-1;
+    disk->stripes[s].path=strdup(paths[s]);
+    if (! disk->stripes[s].path) {
+      free_software_disk(disk);
+      sderror=SD_INTERNAL_ERROR;
+      return NULL;
+    }
+  }
+  return disk;
+}
+
+// closes 'disk' and frees its handle.  A thread still using it goes back
+// to the default disk.
+void free_software_disk(SoftwareDisk disk) {
+  SoftwareDiskInternals *saved=sd;
+  unsigned long s;
+
+  sderror=SD_NONE;
+  if (! disk || disk == &default_sd) {
+    return;
+  }
+  sd=disk;
+  lock_disk(1);
+  close_backing_store();
+  fs_rwunlock(&sd->lock);
+  sd=saved == disk ? &default_sd : saved;
+  if (disk->nstripes > 0) {
+#if defined(FS_THREAD_SAFE)
+    pthread_mutex_destroy(&disk->pool_lock);
+    pthread_cond_destroy(&disk->work);
+    pthread_cond_destroy(&disk->finished);
+#endif
+    for (s=0; s < disk->nstripes; s++) {
+      free(disk->stripes[s].path);
+    }
+  }
+  free(disk->stripes);
+  while (disk->aligned_free) {
+    void *block=disk->aligned_free;
+    disk->aligned_free=*(void **)block;
+    free(block);
+  }
+  fs_lock_destroy(&disk->aligned_lock);
+  fs_rwlock_destroy(&disk->lock);
+  fs_lock_destroy(&disk->gate);
+  free(disk->path);
+  free(disk);
+}
+
+// makes 'disk' the one the calling thread's calls act on, NULL for the
+// default disk.  Returns the disk used until now.
+SoftwareDisk use_software_disk(SoftwareDisk disk) {
+  SoftwareDiskInternals *prev=sd;
+  sd=disk ? disk : &default_sd;
+  return prev;
+}
+
+// returns the disk the calling thread's calls act on.
+SoftwareDisk current_software_disk(void) {
+  return sd;
+}
+
+// selects how the backing store is accessed.  Any open backing store is
+// closed first, so this is normally called once before
+// init_software_disk() or the first block access.  Returns 1 on success,
+// otherwise 0.  Always sets global 'sderror'.
+int select_sd_backend(SDBackend backend) {
+  sderror=SD_NONE;
+  if ((backend != SD_BACKEND_STDIO && backend != SD_BACKEND_MMAP && backend != SD_BACKEND_DIRECT)
+      || (backend == SD_BACKEND_MMAP && sd->nstripes > 0)) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+#if ! defined(O_DIRECT) && ! defined(F_NOCACHE)
+  if (backend == SD_BACKEND_DIRECT) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+#endif
+  lock_disk(1);
+  if (sd->map) {
+    msync(sd->map, (size_t)sd->nblocks * SOFTWARE_DISK_BLOCK_SIZE, MS_SYNC);
+  }
+  close_backing_store();
+  sd->backend=backend;
+  fs_rwunlock(&sd->lock);
+  return 1;
+}
+
+// zeroes a new backing store of 'nblocks' blocks and leaves it open for
+// the current backend.  The caller holds the disk's lock.
+static int format_backing_store(unsigned long nblocks) {
+  sderror=SD_NONE;
+  if (nblocks == 0) {
     sderror=SD_ILLEGAL_BLOCK_NUMBER;
     return 0;
   }
+  close_backing_store();
+  sd->nblocks=nblocks;
+  if (sd->nstripes > 0) {
+    return create_stripes(nblocks);
+  }
+  sd->fp=fopen(sd->path, "w+");
+  if (! sd->fp) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  // the store is truncated to nothing, then extended: the kernel reads
+  // blocks that were never written as zeros and doesn't store them, so
+  // this takes the same time whatever the size of the disk
+  if (ftruncate(fileno(sd->fp), (off_t)nblocks * SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+    fclose(sd->fp);
+    sd->fp=NULL;
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  fflush(sd.fp);
+
+  // other backends reopen the freshly zeroed store their own way
+  if (sd->backend != SD_BACKEND_STDIO) {
+    if (fclose(sd->fp) != 0) {
+      sd->fp=NULL;
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    sd->fp=NULL;
+    return open_backing_store_locked();
+  }
   return 1;
 }
 
+// initializes the software disk to all zeros, destroying any existing
+// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
+int init_software_disk() {
+  return init_software_disk_size(NUM_BLOCKS);
+}
+
+// initializes a software disk of 'nblocks' blocks to all zeros,
+// destroying any existing data.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
+int init_software_disk_size(unsigned long nblocks) {
+  int ret;
+  lock_disk(1);
+  ret=format_backing_store(nblocks);
+  fs_rwunlock(&sd->lock);
+  return ret;
+}
+
+// opens an existing software disk and checks that it has been initialized.
+// Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int open_software_disk(void) {
+  sderror=SD_NONE;
+  if (! hold_backing_store()) {
+    return 0;
+  }
+  fs_rwunlock(&sd->lock);
+  return 1;
+}
+
+// closes the software disk.  Returns 1 on success, otherwise 0.  Always
+// sets global 'sderror'.
+int close_software_disk(void) {
+  sderror=SD_NONE;
+  lock_disk(1);
+  close_backing_store();
+  fs_rwunlock(&sd->lock);
+  return 1;
+}
+
+// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
+unsigned long software_disk_size() {
+  unsigned long nblocks;
+  SDError saved=sderror;
+
+  // the size comes from the backing store, so open it if it exists
+  if (! hold_backing_store()) {
+    lock_disk(0);
+  }
+  nblocks=sd->nblocks;
+  fs_rwunlock(&sd->lock);
+  sderror=saved;
+  return nblocks;
+}
+
+// moves 'count' blocks of a striped disk.  They are sorted by stripe and
+// each stripe's share goes to its file as one job, so the shares on
+// different devices are transferred in parallel.  Returns 1 on success.
+static int transfer_striped(int write, void **bufs, unsigned long *blocknums,
+                            unsigned long count) {
+  StripeJob *jobs, **busy;
+  void **sbufs;
+  unsigned long *sblocks;
+  unsigned long i, s, within, n=0, next=0;
+  int ok=0;
+
+  // a lone block needs no sorting
+  if (count == 1) {
+    s=stripe_of(blocknums[0], &within);
+    return transfer_vector(sd->stripes[s].fd, write, bufs, &within, 1);
+  }
+
+  jobs=calloc(sd->nstripes, sizeof(StripeJob));
+  busy=malloc(sd->nstripes * sizeof(StripeJob *));
+  sbufs=malloc(count * sizeof(void *));
+  sblocks=malloc(count * sizeof(unsigned long));
+  if (jobs && busy && sbufs && sblocks) {
+    // count each stripe's share, then lay the shares out side by side
+    for (i=0; i < count; i++) {
+      jobs[stripe_of(blocknums[i], &within)].count++;
+    }
+    for (s=0; s < sd->nstripes; s++) {
+      jobs[s].write=write;
+      jobs[s].fd=sd->stripes[s].fd;
+      jobs[s].bufs=sbufs + next;
+      jobs[s].blocknums=sblocks + next;
+      next+=jobs[s].count;
+      if (jobs[s].count > 0) {
+        busy[n++]=&jobs[s];
+      }
+      jobs[s].count=0;
+    }
+    for (i=0; i < count; i++) {
+      s=stripe_of(blocknums[i], &within);
+      jobs[s].bufs[jobs[s].count]=bufs[i];
+      jobs[s].blocknums[jobs[s].count++]=within;
+    }
+    ok=run_stripe_jobs(busy, n);
+  }
+  free(jobs);
+  free(busy);
+  free(sbufs);
+  free(sblocks);
+  return ok;
+}
+
+// moves 'count' blocks to or from the backing file, or files if the disk
+// is striped.  Returns 1 on success.
+static int move_blocks(int write, void **bufs, unsigned long *blocknums, unsigned long count) {
+  if (sd->nstripes > 0) {
+    return transfer_striped(write, bufs, blocknums, count);
+  }
+  return transfer_vector(sd->backend == SD_BACKEND_DIRECT ? sd->fd : fileno(sd->fp),
+                         write, bufs, blocknums, count);
+}
+
+// takes an aligned block from the disk's pool, allocating one if the pool
+// is empty.  Returns NULL if out of memory.
+static void *get_aligned_block(void) {
+  void *block;
+
+  fs_lock(&sd->aligned_lock);
+  block=sd->aligned_free;
+  if (block) {
+    sd->aligned_free=*(void **)block;
+    sd->aligned_nfree--;
+  }
+  fs_unlock(&sd->aligned_lock);
+  if (! block && posix_memalign(&block, DIRECT_ALIGN, SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+    return NULL;
+  }
+  return block;
+}
+
+// gives 'block' back to the disk's pool, or frees it if the pool is full
+static void put_aligned_block(void *block) {
+  fs_lock(&sd->aligned_lock);
+  if (sd->aligned_nfree < MAX_ALIGNED_FREE) {
+    *(void **)block=sd->aligned_free;
+    sd->aligned_free=block;
+    sd->aligned_nfree++;
+    block=NULL;
+  }
+  fs_unlock(&sd->aligned_lock);
+  free(block);
+}
+
+// moves 'count' blocks on the direct backend, which can only transfer to
+// and from aligned memory.  Aligned buffers are used as they are; the
+// others are staged through blocks from the disk's pool, IOV_MAX at a
+// time.  Returns 1 on success.
+static int transfer_direct(int write, void **bufs, unsigned long *blocknums,
+                           unsigned long count) {
+  void *staged[IOV_MAX];
+  unsigned long i, n;
+  int ok=1;
+
+  while (ok && count > 0) {
+    n=count < IOV_MAX ? count : IOV_MAX;
+    for (i=0; i < n; i++) {
+      staged[i]=bufs[i];
+      if ((uintptr_t)bufs[i] % DIRECT_ALIGN != 0) {
+        staged[i]=get_aligned_block();
+        if (! staged[i]) {
+          n=i;
+          ok=0;
+        }
+        else if (write) {
+          memcpy(staged[i], bufs[i], SOFTWARE_DISK_BLOCK_SIZE);
+        }
+      }
+    }
+    ok=ok && move_blocks(write, staged, blocknums, n);
+    for (i=0; i < n; i++) {
+      if (staged[i] != bufs[i]) {
+        if (ok && ! write) {
+          memcpy(bufs[i], staged[i], SOFTWARE_DISK_BLOCK_SIZE);
+        }
+        put_aligned_block(staged[i]);
+      }
+    }
+    bufs+=n;
+    blocknums+=n;
+    count-=n;
+  }
+  return ok;
+}
+
+// moves 'count' blocks between 'bufs' and 'blocknums', coalescing runs of
+// consecutive block numbers into single vectored transfers.  The disk's
+// lock is held for reading throughout, so the backing store stays as it
+// is until the transfer is done.
+static int transfer_blocks(int write, void **bufs, unsigned long *blocknums,
+                           unsigned long count) {
+  unsigned long i;
+  int ok=1;
+
+  sderror=SD_NONE;
+  if (! hold_backing_store()) {
+    return 0;
+  }
+
+  for (i=0; i < count && ok; i++) {
+    if (blocknums[i] > sd->nblocks-1) {
+      sderror=SD_ILLEGAL_BLOCK_NUMBER;
+      ok=0;
+    }
+  }
+
+  if (ok && sd->backend == SD_BACKEND_MMAP) {
+    for (i=0; i < count; i++) {
+      char *block=sd->map + blocknums[i] * SOFTWARE_DISK_BLOCK_SIZE;
+      if (write) {
+        memcpy(block, bufs[i], SOFTWARE_DISK_BLOCK_SIZE);
+      }
+      else {
+        memcpy(bufs[i], block, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+    }
+  }
+  else if (ok) {
+    ok=sd->backend == SD_BACKEND_DIRECT ? transfer_direct(write, bufs, blocknums, count)
+                                        : move_blocks(write, bufs, blocknums, count);
+    if (! ok) {
+      sderror=SD_INTERNAL_ERROR;
+    }
+  }
+  fs_rwunlock(&sd->lock);
+  return ok;
+}
+
+// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
+// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_block(void *buf, unsigned long blocknum) {
+  return transfer_blocks(1, &buf, &blocknum, 1);
+}
+
 // reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered 
 // from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum) {
+  return transfer_blocks(0, &buf, &blocknum, 1);
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf',
+// which must hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on
+// success or 0 on failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  void *bufs[IOV_MAX];
+  unsigned long blocknums[IOV_MAX];
+  unsigned long i, n;
 
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror=SD_INTERNAL_ERROR;
+  while (count > 0) {
+    n=count < IOV_MAX ? count : IOV_MAX;
+    for (i=0; i < n; i++) {
+      bufs[i]=(char *)buf + i * SOFTWARE_DISK_BLOCK_SIZE;
+      blocknums[i]=blocknum + i;
+    }
+    if (! transfer_blocks(0, bufs, blocknums, n)) {
       return 0;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
+    buf=(char *)buf + n * SOFTWARE_DISK_BLOCK_SIZE;
+    blocknum+=n;
+    count-=n;
+  }
+  return 1;
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf',
+// which must hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on
+// success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  void *bufs[IOV_MAX];
+  unsigned long blocknums[IOV_MAX];
+  unsigned long i, n;
+
+  sderror=SD_NONE;
+  while (count > 0) {
+    n=count < IOV_MAX ? count : IOV_MAX;
+    for (i=0; i < n; i++) {
+      bufs[i]=(char *)buf + i * SOFTWARE_DISK_BLOCK_SIZE;
+      blocknums[i]=blocknum + i;
+    }
+    if (! transfer_blocks(1, bufs, blocknums, n)) {
+      return 0;
     }
+    buf=(char *)buf + n * SOFTWARE_DISK_BLOCK_SIZE;
+    blocknum+=n;
+    count-=n;
   }
+  return 1;
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
-    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+// scatter read: block 'blocknums[i]' is read into 'bufs[i]' for each of the
+// 'count' entries.  Runs of consecutive block numbers are coalesced into
+// single transfers.  Returns 1 on success or 0 on failure.  Always sets
+// global 'sderror'.
+int readv_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+  return transfer_blocks(0, bufs, blocknums, count);
+}
+
+// gather write: 'bufs[i]' is written to block 'blocknums[i]' for each of
+// the 'count' entries.  Runs of consecutive block numbers are coalesced
+// into single transfers.  Returns 1 on success or 0 on failure.  Always
+// sets global 'sderror'.
+int writev_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count) {
+  return transfer_blocks(1, bufs, blocknums, count);
+}
+
+// forces everything written so far out to the backing store's stable
+// storage.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int sync_software_disk(void) {
+  unsigned long s;
+  int ok=1;
+
+  sderror=SD_NONE;
+  if (! hold_backing_store()) {
     return 0;
   }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  if (sd->backend == SD_BACKEND_MMAP) {
+    ok=msync(sd->map, (size_t)sd->nblocks * SOFTWARE_DISK_BLOCK_SIZE, MS_SYNC) == 0;
+  }
+  else if (sd->nstripes > 0) {
+    for (s=0; s < sd->nstripes && ok; s++) {
+      ok=fsync(sd->stripes[s].fd) == 0;
+    }
+  }
+  else if (sd->backend == SD_BACKEND_DIRECT) {
+    ok=fsync(sd->fd) == 0;
+  }
+  else {
+    ok=fflush(sd->fp) == 0 && fsync(fileno(sd->fp)) == 0;
+  }
+  fs_rwunlock(&sd->lock);
+  if (! ok) {
     sderror=SD_INTERNAL_ERROR;
-    return 0;
   }
-  fflush(sd.fp);
-  return 1;
+  return ok;
 }
 
 // describe current software disk error code by printing a descriptive message to
@@ -148,5 +1091,3 @@ void sd_print_error(void) {
   }
 }
 
-// software disk  error code set (set by each software disk function).
-SDError sderror;
@@ -6,6 +6,8 @@
 #if ! defined(SOFTWARE_DISK_BLOCK_SIZE)
 #define SOFTWARE_DISK_BLOCK_SIZE 4096
 
+#include "fslock.h"
+
 // software disk error codes
 typedef enum  {
   SD_NONE,
@@ -14,13 +16,88 @@ typedef enum  {
   SD_INTERNAL_ERROR          // the software disk has failed
 } SDError;
 
+// ways of accessing the backing store
+typedef enum {
+  SD_BACKEND_STDIO,          // pread/pwrite on the stdio stream's descriptor
+  SD_BACKEND_MMAP,           // memcpy into/out of a shared mapping
+  SD_BACKEND_DIRECT          // pread/pwrite that bypass the page cache
+} SDBackend;
+
+// consecutive blocks a striped disk keeps in one backing file unless
+// told otherwise
+#define DEFAULT_STRIPE_BLOCKS 16
+
+// a software disk and the file backing it.  A process can drive many;
+// each thread's calls act on the one it last selected with
+// use_software_disk(), initially the default disk in "sdprivate.sd".
+struct SoftwareDiskInternals;
+typedef struct SoftwareDiskInternals *SoftwareDisk;
+
 // function prototypes for software disk API
 
+// makes a handle for the software disk backed by the file at 'path'.
+// Nothing is opened or created until the disk is used.  Returns NULL on
+// failure.  Always sets global 'sderror'.
+SoftwareDisk new_software_disk(const char *path);
+
+// makes a handle for a software disk whose blocks are striped over the
+// 'nfiles' backing files at 'paths', which can be on different devices:
+// 'stripe_blocks' consecutive blocks (0 for DEFAULT_STRIPE_BLOCKS) go to
+// one file, the next ones to the next file, and so on round the files.
+// A multi-block transfer is split by file and, in the thread-safe build,
+// the files are read or written in parallel.  Striped disks use the
+// stdio backend's positional I/O; SD_BACKEND_MMAP can't be selected for
+// them.  Nothing is opened or created until the disk is used.  Returns
+// NULL on failure.  Always sets global 'sderror'.
+SoftwareDisk new_striped_software_disk(const char **paths, unsigned long nfiles,
+                                       unsigned long stripe_blocks);
+
+// closes 'disk' and frees its handle.  The default disk can't be freed.
+// Always sets global 'sderror'.
+void free_software_disk(SoftwareDisk disk);
+
+// makes 'disk' the one the calling thread's software disk calls act on;
+// NULL selects the default disk.  Returns the disk used until now, so it
+// can be restored.
+SoftwareDisk use_software_disk(SoftwareDisk disk);
+
+// returns the disk the calling thread's calls act on.
+SoftwareDisk current_software_disk(void);
+
+// selects how the backing store is accessed (SD_BACKEND_STDIO by default).
+// Any open backing store is closed first, so call this before
+// init_software_disk() or the first block access.  SD_BACKEND_DIRECT
+// opens the store with O_DIRECT (F_NOCACHE on macOS), so blocks are only
+// cached where the caller caches them; buffers that aren't 4096-byte
+// aligned are staged through a pool of aligned blocks.  It fails on
+// systems with neither, and when the backing store is opened on a
+// filesystem that doesn't support it.  Returns 1 on success, otherwise
+// 0.  Always sets global 'sderror'.
+int select_sd_backend(SDBackend backend);
+
 // initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
+// data.  The disk has the default size of 4096 blocks.  Returns 1 on
+// success, otherwise 0. Always sets global 'sderror'.
 int init_software_disk();
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
+// initializes a software disk of 'nblocks' blocks to all zeros,
+// destroying any existing data.  The backing store is created sparse,
+// so this is as fast for a large disk as for a small one.  Returns 1 on
+// success, otherwise 0.  Always sets global 'sderror'.
+int init_software_disk_size(unsigned long nblocks);
+
+// opens an existing software disk and checks that it has been initialized.
+// Block accesses open the disk on demand, so this only moves the check
+// up front.  Returns 1 on success, otherwise 0.  Always sets global
+// 'sderror'.
+int open_software_disk(void);
+
+// closes the software disk.  Returns 1 on success, otherwise 0.  Always
+// sets global 'sderror'.
+int close_software_disk(void);
+
+// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE.
+// An existing disk's size is taken from its backing store.
 unsigned long software_disk_size();
 
 // writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
@@ -33,10 +110,34 @@ int write_sd_block(void *buf, unsigned long blocknum);
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum);
 
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which
+// must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf', which
+// must be of size count * SOFTWARE_DISK_BLOCK_SIZE.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// scatter/gather variants: block 'blocknums[i]' is transferred to/from
+// 'bufs[i]' (each of size SOFTWARE_DISK_BLOCK_SIZE) for i < 'count'.  Runs
+// of consecutive block numbers are coalesced into single vectored I/O
+// calls.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int readv_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+int writev_sd_blocks(void **bufs, unsigned long *blocknums, unsigned long count);
+
+// forces all blocks written so far to stable storage (fsync for the stdio
+// backend, msync for the mmap backend).  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int sync_software_disk(void);
+
 // describe current software disk error code by printing a descriptive message to
 // standard error.
 void sd_print_error(void);
 
 // software disk  error code set (set by each software disk function).
-extern SDError sderror;
+// Each thread has its own in the thread-safe build.
+extern FS_THREAD_LOCAL SDError sderror;
 #endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
+#include "filesystem.c"
+#include "filesystem.h"
+
+// Fills the disk while two interleaved files grow their extent tables
+// into the double indirect block, retries, closes and remounts.  Each
+// round leaves a different number of blocks free, so space runs out at
+// every step of that growth.  Reformats the software disk.
+//
+// Built like formatfs: cc -o testfs5 testfs5.c
+
+#define ROUNDS 24
+
+// fill block 'i' of a file with a pattern only it has
+static void fill(char *buf, int name, int i) {
+  memset(buf, name + i, SOFTWARE_DISK_BLOCK_SIZE);
+  memcpy(buf, &i, sizeof(i));
+}
+
+static int round_ok(int round) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE], rb[SOFTWARE_DISK_BLOCK_SIZE];
+  char *names[2]={"fulla", "fullb"};
+  int blocks[2]={0, 0}, full=0, i, k;
+  unsigned long ret, pad, free0;
+  File f[2];
+
+  if (! format_fs(4096, 16) || ! mount_fs()) {
+    printf("FAIL.  Can't format the software disk.\n");
+    return 0;
+  }
+  free0=fs->data_alloc.nfree;
+
+  // leave room for just over FIRST_LEAF_EXTENT blocks in each file
+  f[0]=create_file("pad");
+  pad=free0 - 2 * FIRST_LEAF_EXTENT - round;
+  memset(buf, 'p', SOFTWARE_DISK_BLOCK_SIZE);
+  for (i=0; i < (int)pad; i++) {
+    if (! f[0] || write_file(f[0], buf, SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE) {
+      printf("FAIL.  Can't write the padding file.\n");
+      return 0;
+    }
+  }
+  close_file(f[0]);
+
+  f[0]=create_file(names[0]);
+  f[1]=create_file(names[1]);
+  if (! f[0] || ! f[1]) {
+    printf("FAIL.  Can't create the test files.\n");
+    return 0;
+  }
+  // alternating blocks give every block its own extent.  Keep on until
+  // neither file can grow.
+  while (full < 2) {
+    full=0;
+    for (k=0; k < 2; k++) {
+      fill(buf, k, blocks[k]);
+      ret=write_file(f[k], buf, SOFTWARE_DISK_BLOCK_SIZE);
+      if (ret == SOFTWARE_DISK_BLOCK_SIZE && fserror == FS_NONE) {
+        blocks[k]++;
+      }
+      else if (ret == 0 && fserror == FS_OUT_OF_SPACE) {
+        full++;
+      }
+      else {
+        printf("FAIL.  write_file returned %lu with ", ret);
+        fs_print_error();
+        return 0;
+      }
+    }
+  }
+
+  // retrying must keep failing without damaging anything
+  for (i=0; i < 3; i++) {
+    for (k=0; k < 2; k++) {
+      fill(buf, k, blocks[k]);
+      if (write_file(f[k], buf, SOFTWARE_DISK_BLOCK_SIZE) != 0 || fserror != FS_OUT_OF_SPACE) {
+        printf("FAIL.  Retried write_file didn't report running out of space.\n");
+        return 0;
+      }
+    }
+  }
+  close_file(f[0]);
+  close_file(f[1]);
+  if (! unmount_fs() || ! mount_fs()) {
+    printf("FAIL.  Remount failed: ");
+    fs_print_error();
+    return 0;
+  }
+
+  for (k=0; k < 2; k++) {
+    f[k]=open_file(names[k], READ_ONLY);
+    if (! f[k] || file_length(f[k]) != (unsigned long)blocks[k] * SOFTWARE_DISK_BLOCK_SIZE) {
+      printf("FAIL.  %s doesn't hold the %d blocks written.\n", names[k], blocks[k]);
+      return 0;
+    }
+    for (i=0; i < blocks[k]; i++) {
+      fill(buf, k, i);
+      if (read_file(f[k], rb, SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE
+          || memcmp(buf, rb, SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+        printf("FAIL.  Block %d of %s reads back wrong.\n", i, names[k]);
+        return 0;
+      }
+    }
+    close_file(f[k]);
+  }
+
+  // deleting everything gives back every block, extent blocks included
+  if (! delete_file(names[0]) || ! delete_file(names[1]) || ! delete_file("pad")
+      || fs->data_alloc.nfree != free0) {
+    printf("FAIL.  %lu of %lu blocks free after deleting everything.\n",
+           (unsigned long)fs->data_alloc.nfree, free0);
+    return 0;
+  }
+  printf("round %d: %d + %d blocks written before the disk filled.\n",
+         round, blocks[0], blocks[1]);
+  return unmount_fs();
+}
+
+int main(void) {
+  int round;
+
+  for (round=0; round < ROUNDS; round++) {
+    if (! round_ok(round)) {
+      return 1;
+    }
+  }
+  printf("PASS.\n");
+
+  // leave a freshly formatted disk behind
+  format_fs(4096, 512);
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
+#include "filesystem.c"
+#include "filesystem.h"
+
+// Seeks past the end of an empty file, which starts out inline, writes
+// one block there and checks that only that block is allocated and the
+// skipped part reads back as zeros, before and after a remount.  A file
+// with inline data keeps it.  Reformats the software disk.
+//
+// Built like formatfs: cc -o testfs6 testfs6.c
+
+#define SKIP_BLOCKS 10
+
+static int check_file(char *name, char *prefix, unsigned long used) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE], rb[SOFTWARE_DISK_BLOCK_SIZE];
+  File f;
+  int i;
+
+  f=open_file(name, READ_ONLY);
+  if (! f || file_length(f) != (SKIP_BLOCKS + 1) * SOFTWARE_DISK_BLOCK_SIZE) {
+    printf("FAIL.  %s has the wrong length.\n", name);
+    return 0;
+  }
+  for (i=0; i <= SKIP_BLOCKS; i++) {
+    memset(buf, i == SKIP_BLOCKS ? 'S' : 0, SOFTWARE_DISK_BLOCK_SIZE);
+    if (i == 0) {
+      memcpy(buf, prefix, strlen(prefix));
+    }
+    if (read_file(f, rb, SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE
+        || memcmp(buf, rb, SOFTWARE_DISK_BLOCK_SIZE) != 0) {
+      printf("FAIL.  Block %d of %s reads back wrong.\n", i, name);
+      return 0;
+    }
+  }
+  close_file(f);
+  printf("%s: %lu data block(s) used.\n", name, used);
+  return 1;
+}
+
+// write 'prefix' to a new file 'name', seek past its end and write a
+// block there.  Returns how many data blocks that took, or -1.
+static long sparse_write(char *name, char *prefix) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE];
+  uint64_t free0=fs->data_alloc.nfree;
+  File f;
+
+  f=create_file(name);
+  if (! f || write_file(f, prefix, strlen(prefix)) != strlen(prefix)
+      || ! seek_file(f, SKIP_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE)) {
+    printf("FAIL.  Can't seek past the end of %s: ", name);
+    fs_print_error();
+    return -1;
+  }
+  memset(buf, 'S', SOFTWARE_DISK_BLOCK_SIZE);
+  if (write_file(f, buf, SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE) {
+    printf("FAIL.  Can't write %s: ", name);
+    fs_print_error();
+    return -1;
+  }
+  close_file(f);
+  return (long)(free0 - fs->data_alloc.nfree);
+}
+
+int main(void) {
+  long empty, hello;
+
+  if (! format_fs(4096, 16) || ! mount_fs()) {
+    printf("FAIL.  Can't format the software disk.\n");
+    return 1;
+  }
+
+  // an empty file needs only the block written; "hello" needs its own too
+  empty=sparse_write("sparse", "");
+  hello=sparse_write("hello", "hello");
+  if (empty != 1 || hello != 2) {
+    printf("FAIL.  Used %ld and %ld data blocks, expected 1 and 2.\n", empty, hello);
+    return 1;
+  }
+  if (! check_file("sparse", "", empty) || ! check_file("hello", "hello", hello)) {
+    return 1;
+  }
+  if (! unmount_fs() || ! mount_fs()
+      || ! check_file("sparse", "", empty) || ! check_file("hello", "hello", hello)) {
+    printf("FAIL.  Files changed across a remount.\n");
+    return 1;
+  }
+  printf("PASS.\n");
+
+  // leave a freshly formatted disk behind
+  unmount_fs();
+  format_fs(4096, 512);
+  return 0;
+}
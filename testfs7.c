@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "softwaredisk.c"
+#include "sdasync.c"
+#include "blockcache.c"
+#include "filesystem.c"
+#include "filesystem.h"
+
+// Buffers a partial block when the disk is full, so the write buffer
+// can't be flushed.  close_file and fsync_file must report running out
+// of space, and once space is freed a retried fsync_file must get the
+// bytes to disk.  Reformats the software disk.
+//
+// Built like formatfs: cc -o testfs7 testfs7.c
+
+#define TAIL "0123456789"
+
+// create 'name' holding one full block
+static File first_block(char *name) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE];
+  File f=create_file(name);
+
+  memset(buf, 'x', SOFTWARE_DISK_BLOCK_SIZE);
+  if (f && write_file(f, buf, SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE) {
+    close_file(f);
+    return NULL;
+  }
+  return f;
+}
+
+int main(void) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE], rb[SOFTWARE_DISK_BLOCK_SIZE];
+  File b, c, filler;
+
+  if (! format_fs(1024, 16) || ! mount_fs()) {
+    printf("FAIL.  Can't format the software disk.\n");
+    return 1;
+  }
+  b=first_block("b");
+  c=first_block("c");
+  filler=create_file("filler");
+  if (! b || ! c || ! filler) {
+    printf("FAIL.  Can't create the test files.\n");
+    return 1;
+  }
+  memset(buf, 'f', SOFTWARE_DISK_BLOCK_SIZE);
+  while (write_file(filler, buf, SOFTWARE_DISK_BLOCK_SIZE) == SOFTWARE_DISK_BLOCK_SIZE) {
+  }
+  if (fserror != FS_OUT_OF_SPACE) {
+    printf("FAIL.  Filling the disk stopped with ");
+    fs_print_error();
+    return 1;
+  }
+  close_file(filler);
+
+  // partial blocks are only buffered, so these writes go through
+  if (write_file(b, TAIL, strlen(TAIL)) != strlen(TAIL)
+      || write_file(c, TAIL, strlen(TAIL)) != strlen(TAIL)) {
+    printf("FAIL.  Buffered writes failed: ");
+    fs_print_error();
+    return 1;
+  }
+  close_file(c);
+  if (fserror != FS_OUT_OF_SPACE) {
+    printf("FAIL.  close_file didn't report running out of space.\n");
+    return 1;
+  }
+  if (fsync_file(b) || fserror != FS_OUT_OF_SPACE) {
+    printf("FAIL.  fsync_file didn't report running out of space.\n");
+    return 1;
+  }
+
+  // with space again the buffered bytes get out
+  if (! delete_file("filler") || ! fsync_file(b)) {
+    printf("FAIL.  Retried fsync_file failed: ");
+    fs_print_error();
+    return 1;
+  }
+  close_file(b);
+  if (fserror != FS_NONE || ! unmount_fs() || ! mount_fs()) {
+    printf("FAIL.  Can't close and remount: ");
+    fs_print_error();
+    return 1;
+  }
+
+  b=open_file("b", READ_ONLY);
+  bzero(buf, SOFTWARE_DISK_BLOCK_SIZE);
+  memcpy(buf, TAIL, strlen(TAIL));
+  if (! b || file_length(b) != SOFTWARE_DISK_BLOCK_SIZE + strlen(TAIL)
+      || ! seek_file(b, SOFTWARE_DISK_BLOCK_SIZE)
+      || read_file(b, rb, strlen(TAIL)) != strlen(TAIL)
+      || memcmp(buf, rb, strlen(TAIL)) != 0) {
+    printf("FAIL.  The buffered bytes didn't reach the disk.\n");
+    return 1;
+  }
+  close_file(b);
+  printf("PASS.\n");
+
+  // leave a freshly formatted disk behind
+  unmount_fs();
+  format_fs(4096, 512);
+  return 0;
+}